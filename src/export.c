@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+
+#include "export.h"
+#include "frames.h"
+#include "util.h"
+
+#include <X11/Xlib-xcb.h>
+#include <xcb/shm.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Number of frames of each lens the ring holds
+#ifndef FRAMES_SLOTS_PER_LENS
+#define FRAMES_SLOTS_PER_LENS 4
+#endif
+
+struct frame_export {
+    int fd;
+    size_t size;
+    unsigned char *base;
+    struct frames_header *header;
+    xcb_shm_seg_t seg;
+    // Where each lens's frames are clipped to
+    struct rect bounds[FRAMES_MAX_LENSES];
+    char *link_path;
+};
+
+static size_t round_up(size_t n, size_t multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+struct frame_export *frame_export_create(
+        Display *d, const char *link_path, const struct rect *bounds, int num_lenses)
+{
+    exit_error_if(num_lenses > FRAMES_MAX_LENSES, "Too many lenses to export");
+    xcb_connection_t *c = XGetXCBConnection(d);
+
+    // Attaching a memfd requires MIT-SHM 1.2 or newer
+    xcb_shm_query_version_reply_t *version =
+        xcb_shm_query_version_reply(c, xcb_shm_query_version(c), NULL);
+    bool has_fd_passing = version != NULL
+        && (version->major_version > 1 || version->minor_version >= 2);
+    free(version);
+    exit_error_if(!has_fd_passing, "The MIT-SHM extension does not support file descriptor passing");
+
+    struct frame_export *e = calloc(1, sizeof(*e));
+    exit_error_if(e == NULL, "Allocating frame export failed");
+
+    // Docked lenses only ever need slots as large as themselves, so only the
+    // cursor lens needs slots for the whole screen
+    struct frames_lens lens_layouts[FRAMES_MAX_LENSES];
+    e->size = FRAMES_HEADER_SIZE;
+    for (int i = 0; i < num_lenses; i++) {
+        struct rect b = bounds[i];
+        e->bounds[i] = b;
+        lens_layouts[i] = (struct frames_lens) {
+            .offset = e->size,
+            .num_slots = FRAMES_SLOTS_PER_LENS,
+            .slot_size = round_up(FRAME_HEADER_SIZE + (size_t) b.width * b.height * 4, 4096),
+            .max_width = b.width,
+            .max_height = b.height
+        };
+        e->size += (size_t) lens_layouts[i].num_slots * lens_layouts[i].slot_size;
+    }
+
+    e->fd = memfd_create("mgnfx-frames", MFD_CLOEXEC);
+    exit_errno_if(e->fd, "Creating frame export memfd failed");
+    exit_errno_if(ftruncate(e->fd, e->size), "Resizing frame export memfd failed");
+    e->base = mmap(NULL, e->size, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, 0);
+    if (e->base == MAP_FAILED) exit_errno("Mapping frame export memfd failed");
+
+    e->header = (struct frames_header *) e->base;
+    *e->header = (struct frames_header) {
+        .magic = FRAMES_MAGIC,
+        .version = FRAMES_VERSION,
+        .num_lenses = num_lenses,
+    };
+    memcpy(e->header->lenses, lens_layouts, num_lenses * sizeof(struct frames_lens));
+
+    // xcb closes the descriptor once it has been sent, so give it a copy
+    int server_fd = fcntl(e->fd, F_DUPFD_CLOEXEC, 0);
+    exit_errno_if(server_fd, "Duplicating frame export memfd failed");
+    e->seg = xcb_generate_id(c);
+    XFlush(d);
+    xcb_generic_error_t *error = xcb_request_check(
+            c, xcb_shm_attach_fd_checked(c, e->seg, server_fd, false));
+    if (error != NULL) {
+        free(error);
+        exit_error("Attaching frame export memory to the X server failed");
+    }
+
+    // memfds have no name in the filesystem, so point consumers at ours
+    // through procfs
+    char target[64];
+    snprintf(target, sizeof(target), "/proc/%d/fd/%d", getpid(), e->fd);
+    e->link_path = strdup(link_path);
+    exit_error_if(e->link_path == NULL, "Allocating frame export path failed");
+    unlink(e->link_path);
+    exit_errno_if(symlink(target, e->link_path), "Creating frame export symlink failed");
+
+    return e;
+}
+
+void frame_export_publish(
+        struct frame_export *e, Display *d, Drawable src,
+        const struct rect *outputs, const double *zooms, int num_lenses)
+{
+    xcb_connection_t *c = XGetXCBConnection(d);
+    XFlush(d);
+
+    // Every copy is requested before waiting for any of them, so that they
+    // all cost a single round trip
+    struct rect areas[FRAMES_MAX_LENSES];
+    struct frame_header *frames[FRAMES_MAX_LENSES] = { NULL };
+    xcb_shm_get_image_cookie_t cookies[FRAMES_MAX_LENSES];
+    for (int i = 0; i < num_lenses; i++) {
+        // GetImage fails for areas outside the drawable, which the bounds
+        // are within
+        if (!rect_intersect(outputs[i], e->bounds[i], &areas[i])) continue;
+
+        struct frames_lens *lens = &e->header->lenses[i];
+        uint64_t sequence = lens->latest + 1;
+        size_t offset = lens->offset + (sequence % lens->num_slots) * lens->slot_size;
+        frames[i] = (struct frame_header *) (e->base + offset);
+        __atomic_store_n(&frames[i]->sequence, 0, __ATOMIC_RELEASE);
+        cookies[i] = xcb_shm_get_image(
+                c, src, areas[i].x, areas[i].y, areas[i].width, areas[i].height,
+                ~0, XCB_IMAGE_FORMAT_Z_PIXMAP, e->seg, offset + FRAME_HEADER_SIZE);
+    }
+
+    for (int i = 0; i < num_lenses; i++) {
+        if (frames[i] == NULL) continue;
+        xcb_shm_get_image_reply_t *reply = xcb_shm_get_image_reply(c, cookies[i], NULL);
+        if (reply == NULL) continue;
+        free(reply);
+
+        struct frame_header *frame = frames[i];
+        uint64_t sequence = e->header->lenses[i].latest + 1;
+        frame->timestamp_ns = get_time_ns();
+        frame->x = areas[i].x;
+        frame->y = areas[i].y;
+        frame->width = areas[i].width;
+        frame->height = areas[i].height;
+        frame->stride = areas[i].width * 4;
+        frame->lens = i;
+        frame->zoom = zooms[i];
+
+        __atomic_store_n(&frame->sequence, sequence, __ATOMIC_RELEASE);
+        __atomic_store_n(&e->header->lenses[i].latest, sequence, __ATOMIC_RELEASE);
+    }
+}
+
+void frame_export_destroy(struct frame_export *e, Display *d) {
+    __atomic_store_n(&e->header->closed, 1, __ATOMIC_RELEASE);
+
+    xcb_connection_t *c = XGetXCBConnection(d);
+    XFlush(d);
+    xcb_shm_detach(c, e->seg);
+    xcb_flush(c);
+
+    unlink(e->link_path);
+    free(e->link_path);
+    munmap(e->base, e->size);
+    close(e->fd);
+    free(e);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "rect.h"
+
+#include <X11/Xlib.h>
+
+// Publishes presented lens frames into a shared memory ring (see `frames.h`)
+// which local consumers can map without any X traffic of their own.
+struct frame_export;
+
+// Create the ring with room for a few frames of each of `num_lenses` lenses,
+// and make it reachable through a symlink at `link_path`. `bounds[i]` is the
+// area of the screen lens `i` can cover: its frames are clipped to it and its
+// slots are only as large as it. Exits on failure.
+struct frame_export *frame_export_create(
+        Display *d, const char *link_path, const struct rect *bounds, int num_lenses);
+
+// Copy the area of `src` showing each lens, `outputs[i]` at a zoom of
+// `zooms[i]` for lens `i`, into the next slot of that lens. The copies are
+// all requested before waiting for any of them.
+void frame_export_publish(
+        struct frame_export *e, Display *d, Drawable src,
+        const struct rect *outputs, const double *zooms, int num_lenses);
+
+void frame_export_destroy(struct frame_export *e, Display *d);
@@ -0,0 +1,72 @@
+#pragma once
+
+// Layout of the shared memory frame ring published with `-x`. This header
+// has no X dependencies so that consumers (see `tools/`) can include it
+// directly.
+//
+// The ring is a single memfd which starts with a `struct frames_header`.
+// Each lens has its own slots, `lenses[i].num_slots` of `lenses[i].slot_size`
+// bytes each starting at `lenses[i].offset`, sized for the largest area that
+// lens can show (`max_width` by `max_height`). Each slot starts with a
+// `struct frame_header` and the pixels follow at `FRAME_HEADER_SIZE` into the
+// slot.
+//
+// Pixels are 32 bits each, stored as B, G, R, X bytes (the X server's native
+// ZPixmap layout for 24-bit depth on little-endian machines).
+//
+// Synchronization: frames of each lens are numbered from 1. The producer sets
+// a slot's `sequence` to 0 before writing it and to the frame's number
+// afterwards, then stores the same number in the lens's `latest`. Frame `n`
+// of a lens is in its slot `n % num_slots`. A consumer reads `latest`, copies
+// each frame after the last one it saw up to `latest` and checks that the
+// slot's `sequence` was equal to the frame's both before and after copying.
+// All of these fields must be accessed atomically. The lens has a few slots
+// so that consumers have time to copy every frame.
+
+#include <stdint.h>
+
+#define FRAMES_MAGIC 0x7866676d // "mgfx"
+#define FRAMES_VERSION 2
+#define FRAMES_HEADER_SIZE 4096
+#define FRAME_HEADER_SIZE 64
+#define FRAMES_MAX_LENSES 64
+
+struct frames_lens {
+    // Sequence number of the lens's most recently completed frame (0 if none)
+    uint64_t latest;
+    // Offset of the lens's first slot from the start of the ring
+    uint64_t offset;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t max_width;
+    uint32_t max_height;
+};
+
+struct frames_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_lenses;
+    // Set to non-zero by the producer when it stops publishing frames
+    uint32_t closed;
+    struct frames_lens lenses[FRAMES_MAX_LENSES];
+};
+
+struct frame_header {
+    uint64_t sequence;
+    // CLOCK_MONOTONIC time at which the frame was presented
+    uint64_t timestamp_ns;
+    // Position and size of the lens on the screen
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    // Bytes per row of pixels
+    uint32_t stride;
+    // Index of the lens shown in the frame, 0 being the lens which follows
+    // the cursor
+    uint32_t lens;
+    double zoom;
+};
+
+_Static_assert(sizeof(struct frames_header) <= FRAMES_HEADER_SIZE, "frames_header too large");
+_Static_assert(sizeof(struct frame_header) <= FRAME_HEADER_SIZE, "frame_header too large");
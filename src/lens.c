@@ -0,0 +1,75 @@
+#include "lens.h"
+
+#include <math.h>
+
+void lens_get_centre(const struct lens *lens, int cursor_x, int cursor_y, int *x, int *y) {
+    if (lens->docked) {
+        *x = lens->src_x;
+        *y = lens->src_y;
+    } else {
+        *x = cursor_x;
+        *y = cursor_y;
+    }
+}
+
+struct rect lens_get_source(const struct lens *lens, int cursor_x, int cursor_y) {
+    int centre_x;
+    int centre_y;
+    lens_get_centre(lens, cursor_x, cursor_y, &centre_x, &centre_y);
+
+    // Round outwards so that partially visible source pixels are included
+    int left = floor(centre_x - lens->width / 2 / lens->scale);
+    int top = floor(centre_y - lens->height / 2 / lens->scale);
+    int right = ceil(centre_x + (lens->width - lens->width / 2) / lens->scale);
+    int bottom = ceil(centre_y + (lens->height - lens->height / 2) / lens->scale);
+    return (struct rect) { left, top, right - left + 1, bottom - top + 1 };
+}
+
+struct rect lens_get_output(const struct lens *lens, int cursor_x, int cursor_y) {
+    if (lens->docked) {
+        return (struct rect) { lens->x, lens->y, lens->width, lens->height };
+    } else {
+        return (struct rect) {
+            cursor_x - lens->width / 2, cursor_y - lens->height / 2,
+            lens->width, lens->height
+        };
+    }
+}
+
+struct rect lens_get_border(const struct lens *lens, int cursor_x, int cursor_y) {
+    struct rect output = lens_get_output(lens, cursor_x, cursor_y);
+    return (struct rect) {
+        output.x - LENS_BORDER, output.y - LENS_BORDER,
+        output.width + LENS_BORDER * 2, output.height + LENS_BORDER * 2
+    };
+}
+
+bool lens_pan(struct lens *lens, int cursor_x, int cursor_y, int margin, int screen_width, int screen_height) {
+    // Size of the viewport and the margin in screen pixels
+    double view_width = lens->width / lens->scale;
+    double view_height = lens->height / lens->scale;
+    double margin_x = fmin(margin / lens->scale, view_width / 2);
+    double margin_y = fmin(margin / lens->scale, view_height / 2);
+
+    double left = lens->src_x - view_width / 2;
+    double top = lens->src_y - view_height / 2;
+    if (cursor_x < left + margin_x) {
+        left = cursor_x - margin_x;
+    } else if (cursor_x > left + view_width - margin_x) {
+        left = cursor_x + margin_x - view_width;
+    }
+    if (cursor_y < top + margin_y) {
+        top = cursor_y - margin_y;
+    } else if (cursor_y > top + view_height - margin_y) {
+        top = cursor_y + margin_y - view_height;
+    }
+    left = fmax(0, fmin(left, screen_width - view_width));
+    top = fmax(0, fmin(top, screen_height - view_height));
+
+    int src_x = lround(left + view_width / 2);
+    int src_y = lround(top + view_height / 2);
+    bool moved = src_x != lens->src_x || src_y != lens->src_y;
+    lens->src_x = src_x;
+    lens->src_y = src_y;
+    return moved;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "rect.h"
+
+#include <stdbool.h>
+
+#ifndef MAX_LENSES
+#define MAX_LENSES 8
+#endif
+
+// Width of the black border drawn around each lens
+#define LENS_BORDER 2
+
+struct lens {
+    // Size of the magnified image on the screen
+    int width;
+    int height;
+    double scale;
+
+    // A docked lens always magnifies the area centred on (`src_x`, `src_y`)
+    // and shows it with its top left corner at (`x`, `y`). Other lenses are
+    // centred on the cursor.
+    bool docked;
+    int x;
+    int y;
+    int src_x;
+    int src_y;
+};
+
+// Get the point on the screen the lens magnifies around
+void lens_get_centre(const struct lens *lens, int cursor_x, int cursor_y, int *x, int *y);
+
+// Get the area of the screen which is magnified by the lens
+struct rect lens_get_source(const struct lens *lens, int cursor_x, int cursor_y);
+
+// Get the area of the screen the lens covers, not including its border
+struct rect lens_get_output(const struct lens *lens, int cursor_x, int cursor_y);
+
+// Get the area of the screen the lens covers, including its border
+struct rect lens_get_border(const struct lens *lens, int cursor_x, int cursor_y);
+
+// Move the centre of a docked lens's source just enough to keep the cursor
+// at least `margin` output pixels inside the edges of the area it magnifies,
+// without the area leaving the screen. Returns true if the centre moved.
+bool lens_pan(struct lens *lens, int cursor_x, int cursor_y, int margin, int screen_width, int screen_height);
@@ -4,10 +4,13 @@
 #include <X11/Xatom.h>
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/composite.h>
+#include <X11/extensions/Xcomposite.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xrandr.h> 
 #include <X11/extensions/shape.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/shape.h>
 
 #include <libinput.h>
 #include <libevdev-1.0/libevdev/libevdev.h>
@@ -15,9 +18,11 @@
 #include <linux/input-event-codes.h>
 
 #include <assert.h>
+#include <math.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -28,6 +33,17 @@
 #include <stdlib.h>
 #include <sys/file.h>
 
+#include "export.h"
+#include "lens.h"
+#include "mipmap.h"
+#include "predict.h"
+#include "realtime.h"
+#include "record.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+#include "windows.h"
+
 #define XSTR(s) #s
 #define STR(s) XSTR(s)
 
@@ -91,19 +107,48 @@
 #define DEFAULT_ZOOM_OUT_KEY "KEY_MINUS"
 #endif
 
+#ifndef DEFAULT_FREEZE_KEY
+#define DEFAULT_FREEZE_KEY "KEY_F"
+#endif
+
 #ifndef DEFAULT_MODIFIER_KEYS
 #define DEFAULT_MODIFIER_KEYS "KEY_LEFTMETA", "KEY_LEFTCTRL"
 #define NUM_DEFAULT_MODIFIER_KEYS 2
 #endif
 
+#ifndef DEFAULT_EDGE_MARGIN
+#define DEFAULT_EDGE_MARGIN 100
+#endif
+
 #ifndef MAX_SCALE
 #define MAX_SCALE 10.0
 #endif
 
 #ifndef MIN_SCALE
-#define MIN_SCALE 1.0
+#define MIN_SCALE 0.1
+#endif
+
+// Most areas captured in one frame: one per lens, plus runs of dirty mipmap
+// tiles for lenses which shrink the screen
+#define MAX_SOURCES 64
+
+#ifndef ZOOM_SMOOTHING
+// Fraction of the way to the target zoom the zoom moves each frame
+#define ZOOM_SMOOTHING 0.3
+#endif
+
+#ifndef TILED_LENS_AREA
+// Lenses covering more of the screen than this are drawn in tiles
+#define TILED_LENS_AREA (1024 * 1024)
 #endif
 
+#ifndef LENS_TILE_SIZE
+#define LENS_TILE_SIZE 256
+#endif
+
+// Tiles are made larger on screens which would need more than this
+#define MAX_LENS_TILES 256
+
 #ifndef WINDOW_TITLE
 #define WINDOW_TITLE "Magnifier"
 #endif
@@ -117,26 +162,6 @@ static char pidfile_name[256] = PIDFILE_NAME;
 static const int ATOM_SIZE = 32;
 
 
-// Print an error message to stderr, then exit with status 1
-void exit_error(const char *msg) {
-    fprintf(stderr, "%s\n", msg);
-    exit(1);
-}
-
-void exit_errno(const char *msg) {
-    fprintf(stderr, "%s: %s.\n", msg, strerror(errno));
-    exit(1);
-}
-
-void exit_error_if(bool cond, const char *msg) {
-    if (cond) exit_error(msg);
-}
-
-void exit_errno_if(int cond, const char *msg) {
-    if (cond == -1) exit_errno(msg);
-}
-
-
 struct opts {
     unsigned int width;
     unsigned int height;
@@ -154,8 +179,47 @@ struct opts {
     uint32_t shrink_height_key;
     uint32_t zoom_in_key;
     uint32_t zoom_out_key;
+    uint32_t freeze_key;
     uint32_t modifier_keys[10];
     unsigned int num_modifier_keys;
+
+    // Path of the symlink to the shared memory frame ring, or NULL
+    const char *export_path;
+
+    // Lenses pinned to a fixed area of the screen, in addition to the lens
+    // which follows the cursor
+    struct lens docked_lenses[MAX_LENSES - 1];
+    unsigned int num_docked_lenses;
+
+    // Capture from the windows' composite pixmaps instead of the screen
+    bool composite;
+
+    // Path of the trace file to write on exit, or NULL
+    const char *trace_path;
+
+    // Path to record input, damage and window events to, or NULL
+    const char *record_path;
+    // Path of a recording to replay instead of reading input, or NULL
+    const char *replay_path;
+
+    // Centre the cursor lens on where the cursor is predicted to be when the
+    // frame is presented
+    bool predict;
+
+    // Seconds between printing statistics, or 0 to not collect them
+    double stats_interval;
+
+    // Real-time scheduling policy (SCHED_FIFO or SCHED_RR) and priority, or
+    // a policy of -1 to keep the default
+    int rt_policy;
+    int rt_priority;
+    bool lock_memory;
+    bool min_timer_slack;
+
+    // Magnify the whole screen, panning when the cursor comes within
+    // `edge_margin` pixels of the edge of the magnified area
+    bool fullscreen;
+    unsigned int edge_margin;
 };
 
 static uint32_t get_key_by_name(const char *name) {
@@ -184,7 +248,11 @@ static void get_opts(int argc, char **argv, struct opts *opts) {
         .grow_height_key = get_key_by_name(DEFAULT_GROW_HEIGHT_KEY),
         .shrink_height_key = get_key_by_name(DEFAULT_SHRINK_HEIGHT_KEY),
         .zoom_in_key = get_key_by_name(DEFAULT_ZOOM_IN_KEY),
-        .zoom_out_key = get_key_by_name(DEFAULT_ZOOM_OUT_KEY)
+        .zoom_out_key = get_key_by_name(DEFAULT_ZOOM_OUT_KEY),
+        .freeze_key = get_key_by_name(DEFAULT_FREEZE_KEY),
+        .rt_policy = -1,
+        .rt_priority = DEFAULT_RT_PRIORITY,
+        .edge_margin = DEFAULT_EDGE_MARGIN
     };
 
     for (int i = 0; i < argc; i++) {
@@ -196,7 +264,7 @@ static void get_opts(int argc, char **argv, struct opts *opts) {
                     "-h PIXELS     magnifier height in pixels (default " STR(DEFAULT_HEIGHT) ")\n"
                     "-W PIXELS     width resize increment in pixels (default " STR(DEFAULT_WIDTH_STEP) ")\n"
                     "-H PIXELS     height resize increment in pixels (default " STR(DEFAULT_HEIGHT_STEP) ")\n"
-                    "-s DECIMAL    zoom scale (default " STR(DEFAULT_ZOOM) ")\n"
+                    "-s DECIMAL    zoom scale, below 1 for a shrunken overview (default " STR(DEFAULT_ZOOM) ")\n"
                     "-z DECIMAL    zoom scale coefficient (default " STR(DEFAULT_ZOOM_SCALE) ")\n"
                     "-Z DECIMAL    zoom scale increment (default " STR(DEFAULT_ZOOM_STEP) ")\n"
                     "-r NUMBER     max redraws per second (default " STR(DEFAULT_RATE) ")\n"
@@ -207,7 +275,31 @@ static void get_opts(int argc, char **argv, struct opts *opts) {
                     "-E KEY_NAME   key binding to decrease magnifier height (default " DEFAULT_SHRINK_HEIGHT_KEY ")\n"
                     "-n KEY_NAME   key binding to zoom in (default " DEFAULT_ZOOM_IN_KEY ")\n"
                     "-o KEY_NAME   key binding to zoom out (default " DEFAULT_ZOOM_OUT_KEY ")\n"
+                    "-F KEY_NAME   key binding to freeze and unfreeze the magnified image\n"
+                    "              (default " DEFAULT_FREEZE_KEY ")\n"
                     "-m KEY_NAME   specify a single modifier key\n"
+                    "-x PATH       publish lens frames to a shared memory ring linked at PATH\n"
+                    "-t PATH       write a Chrome trace of the most recent frames to PATH on exit\n"
+                    "-R PATH       record input, damage and window events to PATH\n"
+                    "-Y PATH       replay a recording made with -R (meant for a fresh Xvfb) and\n"
+                    "              print frame time statistics when it ends\n"
+                    "-p            centre the lens on the predicted cursor position at the time\n"
+                    "              the frame is shown, extrapolated from pointer motion\n"
+                    "-S SECONDS    print render loop statistics every SECONDS and on exit\n"
+                    "-T POLICY[,PRIORITY]\n"
+                    "              run with the real-time scheduling POLICY (fifo or rr), or\n"
+                    "              with a lower nice value if that isn't allowed\n"
+                    "              (default priority " STR(DEFAULT_RT_PRIORITY) ")\n"
+                    "-L            lock all memory once set up, to avoid page faults\n"
+                    "-k            set the timer slack to 1 ns for precise frame pacing\n"
+                    "-f            magnify the whole screen and the cursor, panning to follow it\n"
+                    "-M PIXELS     in full-screen mode, pan when the magnified cursor is this\n"
+                    "              close to the edge of the screen (default " STR(DEFAULT_EDGE_MARGIN) ")\n"
+                    "-c            capture windows from their composite pixmaps, redirecting\n"
+                    "              them if no compositing manager is running\n"
+                    "-d X,Y,WIDTH,HEIGHT,SRC_X,SRC_Y[,DECIMAL]\n"
+                    "              add a lens at X,Y which magnifies around SRC_X,SRC_Y\n"
+                    "              (default zoom scale is the -s value)\n"
                     "The default modifier keys are " STR((DEFAULT_MODIFIER_KEYS)) "\n\n"
                     "Usage:\n"
 "Press the quit key at any time to exit the program. While the program is\n"
@@ -217,13 +309,15 @@ static void get_opts(int argc, char **argv, struct opts *opts) {
 "- Resize the magnified region by clicking and dragging with the mouse\n"
 "- Resize the magnified region according to the resize increments using the resize keys\n"
 "- Change the zoom level by scrolling with the mouse (scaled by zoom scale coefficient)\n"
-"- Change the zoom level according to the zoom scale increment using the zoom in/out keys");
+"- Change the zoom level according to the zoom scale increment using the zoom in/out keys\n"
+"- Freeze the magnified image using the freeze key, to inspect it without it\n"
+"  changing, and unfreeze it by pressing the freeze key again");
             exit(1);
         }
     }
 
     int optchar;
-    while ((optchar = getopt(argc, argv, "w:h:W:H:s:z:Z:r:q:i:I:e:E:n:o:m:")) != -1) {
+    while ((optchar = getopt(argc, argv, "w:h:W:H:s:z:Z:r:q:i:I:e:E:n:o:F:m:x:d:ct:R:Y:pS:T:LkfM:")) != -1) {
         switch (optchar) {
             case 'w':
                 opts->width = atoi(optarg);
@@ -270,6 +364,9 @@ static void get_opts(int argc, char **argv, struct opts *opts) {
             case 'o':
                 opts->zoom_out_key = get_key_by_name(optarg);
                 break;
+            case 'F':
+                opts->freeze_key = get_key_by_name(optarg);
+                break;
             case 'm':
                 const unsigned int max_modifier_keys = sizeof(opts->modifier_keys) / sizeof(opts->modifier_keys[0]);
                 if (opts->num_modifier_keys >= max_modifier_keys) {
@@ -279,8 +376,83 @@ static void get_opts(int argc, char **argv, struct opts *opts) {
                     opts->num_modifier_keys++;
                 }
                 break;
+            case 'x':
+                opts->export_path = optarg;
+                break;
+            case 'c':
+                opts->composite = true;
+                break;
+            case 't':
+                opts->trace_path = optarg;
+                break;
+            case 'R':
+                opts->record_path = optarg;
+                break;
+            case 'Y':
+                opts->replay_path = optarg;
+                break;
+            case 'p':
+                opts->predict = true;
+                break;
+            case 'S':
+                opts->stats_interval = strtod(optarg, NULL);
+                break;
+            case 'T':
+                char policy_name[8];
+                int num_policy_fields = sscanf(optarg, "%7[a-z],%d", policy_name, &opts->rt_priority);
+                if (num_policy_fields >= 1 && strcmp(policy_name, "fifo") == 0) {
+                    opts->rt_policy = SCHED_FIFO;
+                } else if (num_policy_fields >= 1 && strcmp(policy_name, "rr") == 0) {
+                    opts->rt_policy = SCHED_RR;
+                } else {
+                    fprintf(stderr, "`%s` is not a valid scheduling policy\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'L':
+                opts->lock_memory = true;
+                break;
+            case 'k':
+                opts->min_timer_slack = true;
+                break;
+            case 'f':
+                opts->fullscreen = true;
+                break;
+            case 'M':
+                opts->edge_margin = atoi(optarg);
+                break;
+            case 'd':
+                const unsigned int max_docked_lenses = sizeof(opts->docked_lenses) / sizeof(opts->docked_lenses[0]);
+                if (opts->num_docked_lenses >= max_docked_lenses) {
+                    exit_error("Too many lenses");
+                }
+                struct lens *lens = &opts->docked_lenses[opts->num_docked_lenses];
+                *lens = (struct lens) { .docked = true, .scale = 0.0 };
+                int num_fields = sscanf(
+                        optarg, "%d,%d,%d,%d,%d,%d,%lf",
+                        &lens->x, &lens->y, &lens->width, &lens->height,
+                        &lens->src_x, &lens->src_y, &lens->scale);
+                if (num_fields < 6 || lens->width <= 0 || lens->height <= 0) {
+                    fprintf(stderr, "`%s` is not a valid lens\n", optarg);
+                    exit(1);
+                }
+                opts->num_docked_lenses++;
+                break;
         }
     }
+    // Docked lenses without their own zoom use the initial zoom of the
+    // cursor lens
+    for (unsigned int i = 0; i < opts->num_docked_lenses; i++) {
+        struct lens *lens = &opts->docked_lenses[i];
+        if (lens->scale == 0.0) lens->scale = opts->zoom;
+        if (lens->scale < MIN_SCALE) lens->scale = MIN_SCALE;
+        if (lens->scale > MAX_SCALE) lens->scale = MAX_SCALE;
+    }
+    if (opts->fullscreen && opts->num_docked_lenses > 0) {
+        exit_error("Docked lenses can't be used in full-screen mode");
+    }
+    // Shrinking the screen would leave part of the full-screen lens empty
+    if (opts->fullscreen && opts->zoom < 1.0) opts->zoom = 1.0;
     if (opts->num_modifier_keys == 0) {
         opts->num_modifier_keys = NUM_DEFAULT_MODIFIER_KEYS;
         char *default_modifier_keys[] = { DEFAULT_MODIFIER_KEYS };
@@ -312,19 +484,35 @@ static const struct libinput_interface li_interface = {
 };
 
 
-// Try to get an atom with the given name with XInternAtom and exit the program
-// if it doesn't exist (if XInternAtom returns `None`)
-Atom get_atom_not_none(Display *d, char *name) {
-    Atom atom = XInternAtom(d, name, true);
-    if (atom == None) {
-        fprintf(stderr, "XInternAtom returned `None` for \"%s\"\n", name);
-        exit(1);
+struct atom_request {
+    const char *name;
+    Atom *atom;
+    // Whether to create the atom if it doesn't exist, rather than getting
+    // `None` for it
+    bool create;
+};
+
+// Intern all the requested atoms with a single round trip, by sending every
+// request before waiting for any of the replies
+static void intern_atoms(Display *d, const struct atom_request *requests, int num_requests) {
+    xcb_connection_t *c = XGetXCBConnection(d);
+    xcb_intern_atom_cookie_t cookies[num_requests];
+    for (int i = 0; i < num_requests; i++) {
+        const char *name = requests[i].name;
+        cookies[i] = xcb_intern_atom(c, !requests[i].create, strlen(name), name);
+    }
+    for (int i = 0; i < num_requests; i++) {
+        xcb_generic_error_t *error = NULL;
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(c, cookies[i], &error);
+        *requests[i].atom = reply != NULL ? reply->atom : None;
+        free(reply);
+        free(error);
     }
-    return atom;
 }
 
-Pixmap get_root_background_pixmap(Display *d, Window root) {
-    Atom root_pixmap = get_atom_not_none(d, "_XROOTPMAP_ID");
+Pixmap get_root_background_pixmap(Display *d, Window root, Atom root_pixmap) {
+    // No wallpaper has ever been set (e.g. on a fresh Xvfb)
+    if (root_pixmap == None) return None;
 
     Atom actual_type;
     int actual_format;
@@ -356,6 +544,12 @@ static int wait_for_event(Display *d, XEvent *x_ev, int event_type) {
     return XIfEvent(d, x_ev, wait_for_event_predicate, (XPointer) &event_type);
 }
 
+static double clamp_scale(double min_scale, double scale) {
+    if (scale < min_scale) return min_scale;
+    if (scale > MAX_SCALE) return MAX_SCALE;
+    return scale;
+}
+
 static int int_min(int i1, int i2) {
     return i1 < i2 ? i1 : i2;
 }
@@ -402,66 +596,140 @@ static bool get_cursor_position(
     return pointer_is_on_screen;
 }
 
-static bool has_extension(Display *d, const char *name) {
-    int dummy_int;
-    bool has_extension = XQueryExtension(d, name, &dummy_int, &dummy_int, &dummy_int);
-    if (!has_extension) {
-        fprintf(stderr, "The \"%s\" extension is not available\n", name);
+// Check whether all of the named extensions are available, with a single
+// round trip
+static bool has_extensions(Display *d, const char **names, int num_names) {
+    xcb_connection_t *c = XGetXCBConnection(d);
+    xcb_query_extension_cookie_t cookies[num_names];
+    for (int i = 0; i < num_names; i++) {
+        cookies[i] = xcb_query_extension(c, strlen(names[i]), names[i]);
     }
-    return has_extension;
+    bool has_all_extensions = true;
+    for (int i = 0; i < num_names; i++) {
+        xcb_generic_error_t *error = NULL;
+        xcb_query_extension_reply_t *reply = xcb_query_extension_reply(c, cookies[i], &error);
+        bool has_extension = reply != NULL && reply->present;
+        if (!has_extension) {
+            fprintf(stderr, "The \"%s\" extension is not available\n", names[i]);
+        }
+        has_all_extensions &= has_extension;
+        free(reply);
+        free(error);
+    }
+    return has_all_extensions;
 }
 
-static void init_extension(Display *d, const char *name) {
-    XExtCodes *codes = XInitExtension(d, name);
-    if (codes == NULL) {
-        fprintf(stderr, "Initializing the \"%s\" extension failed\n", name);
-        exit(1);
+// Get a picture of the window's composite pixmap, naming the pixmap first if
+// that hasn't been done since the window was last mapped or resized.
+static Picture get_window_picture(
+        Display *d, struct indexed_window *window,
+        XRenderPictFormat *format_32, XRenderPictFormat *format_24)
+{
+    if (window->picture == None) {
+        window->pixmap = XCompositeNameWindowPixmap(d, window->id);
+        window->picture = XRenderCreatePicture(
+                d, window->pixmap, window->depth == 24 ? format_24 : format_32, 0, NULL);
     }
+    return window->picture;
 }
 
-void draw(
-        int width, int height, double scale, int cursor_x, int cursor_y,
-        Pixmap dest_pixmap, Pixmap final_pixmap,
-        Picture dest_pic, Picture final_pic,
-        XWindowAttributes root_attr, XWindowAttributes dest_attr,
-        Window root, Window w, Display *d, GC gc,
+// The server allocates a new pixmap for a window whenever it is mapped or
+// resized, so the old name must be dropped then.
+static void release_window_picture(Display *d, struct indexed_window *window) {
+    if (window->picture != None) XRenderFreePicture(d, window->picture);
+    if (window->pixmap != None) XFreePixmap(d, window->pixmap);
+    window->picture = None;
+    window->pixmap = None;
+}
+
+// What `draw()` captures before drawing the lenses
+enum capture_mode {
+    // Only the areas magnified by the lenses
+    CAPTURE_LENSES,
+    // The whole screen, so that the lenses can be drawn from it while frozen
+    CAPTURE_SCREEN,
+    // The lens sources, but the cursor lens's source at a zoom of 1, so that
+    // zooming it in doesn't need another capture (zooming out further is
+    // drawn from the mipmap)
+    CAPTURE_ZOOM,
+    // Nothing; the lenses are drawn from the previous capture
+    CAPTURE_NONE
+};
+
+// Capture the `sources` areas of the screen, which are within
+// `capture_bounds`, into `dest_pixmap`
+static void capture(
+        const struct rect *sources, int num_sources, struct rect capture_bounds,
+        Pixmap dest_pixmap, Picture dest_pic,
+        struct window_index *window_index, bool composite,
+        Pixmap root_background, Window root, Display *d, GC gc,
         XRenderPictFormat *format_32, XRenderPictFormat *format_24, XRenderPictFormat *format_1)
 {
-    int dummy_int;
+    uint64_t span_start = trace_now();
+
+    XRectangle source_rects[MAX_SOURCES];
+    for (int i = 0; i < num_sources; i++) {
+        source_rects[i] = (XRectangle) {
+            sources[i].x, sources[i].y, sources[i].width, sources[i].height
+        };
+    }
+    XserverRegion capture_region = XFixesCreateRegion(d, source_rects, num_sources);
+    XFixesSetGCClipRegion(d, gc, 0, 0, capture_region);
+    XFixesSetPictureClipRegion(d, dest_pic, 0, 0, capture_region);
+    XFixesDestroyRegion(d, capture_region);
+    trace_span("capture setup", 0, span_start);
 
     // Copy wallpaper
-    Pixmap root_background_pixmap = get_root_background_pixmap(d, root);
-    if (root_background_pixmap != None) {
-        XCopyArea(d, root_background_pixmap, dest_pixmap, gc, 0, 0, root_attr.width, root_attr.height, 0, 0);
+    span_start = trace_now();
+    if (root_background != None) {
+        XCopyArea(d, root_background, dest_pixmap, gc, capture_bounds.x, capture_bounds.y, capture_bounds.width, capture_bounds.height, capture_bounds.x, capture_bounds.y);
     } else {
         XSetForeground(d, gc, BlackPixel(d, DefaultScreen(d)));
-        XFillRectangle(d, dest_pixmap, gc, 0, 0, root_attr.width, root_attr.height);
+        XFillRectangle(d, dest_pixmap, gc, capture_bounds.x, capture_bounds.y, capture_bounds.width, capture_bounds.height);
     }
-
-    Window dummy_window;
-
-    unsigned int num_windows = 0;
-    Window *windows = NULL;
-    XQueryTree(d, root, &dummy_window, &dummy_window, &windows, &num_windows);
-
+    XFixesSetGCClipRegion(d, gc, 0, 0, None);
+    trace_span("wallpaper", 0, span_start);
+
+    // Only the viewable top-level windows which overlap the captured area
+    // are drawn, bottom-most first
+    span_start = trace_now();
+    struct indexed_window **windows;
+    unsigned int num_windows = window_index_query(window_index, capture_bounds, &windows);
+    trace_span("window query", 0, span_start);
+
+    // Ask for the shapes of all the windows to draw at once, so that waiting
+    // for them costs a single round trip
+    span_start = trace_now();
+    xcb_connection_t *c = XGetXCBConnection(d);
+    unsigned int num_drawn = 0;
+    struct indexed_window *drawn[num_windows > 0 ? num_windows : 1];
+    xcb_shape_get_rectangles_cookie_t shape_cookies[num_windows > 0 ? num_windows : 1];
     for (unsigned int i = 0; i < num_windows; i++) {
-        Window src_w = windows[i];
-        if (src_w == w) continue;
-
-        Status status;
-
-        XWindowAttributes src_attr;
-        status = XGetWindowAttributes(d, src_w, &src_attr);
-        if (status == 0 || src_attr.map_state != IsViewable) continue;
-
-        // Don't draw windows which aren't direct children of the root window
-        Window parent_w = None;
-        unsigned int num_child_windows;
-        Window *child_windows = NULL;
-        status = XQueryTree(d, src_w, &dummy_window, &parent_w, &child_windows, &num_child_windows);
-        if (status == 0) continue;
-        if (child_windows != NULL) XFree(child_windows);
-        if (parent_w != root) continue;
+        // Skip windows which don't overlap any of the captured areas
+        bool overlaps_source = false;
+        for (int j = 0; j < num_sources && !overlaps_source; j++) {
+            overlaps_source = rect_overlaps(windows[i]->rect, sources[j]);
+        }
+        if (!overlaps_source) continue;
+        drawn[num_drawn] = windows[i];
+        shape_cookies[num_drawn++] = xcb_shape_get_rectangles(c, windows[i]->id, XCB_SHAPE_SK_BOUNDING);
+    }
+    trace_span("shape query", 0, span_start);
+
+    for (unsigned int i = 0; i < num_drawn; i++) {
+        span_start = trace_now();
+        Window src_w = drawn[i]->id;
+        struct rect src_rect = drawn[i]->rect;
+        int depth = drawn[i]->depth;
+        // Composite pixmaps include the window border
+        int pic_offset = composite ? drawn[i]->border_width : 0;
+
+        // There is no reply if the window has been destroyed since
+        xcb_generic_error_t *error = NULL;
+        xcb_shape_get_rectangles_reply_t *shape =
+            xcb_shape_get_rectangles_reply(c, shape_cookies[i], &error);
+        free(error);
+        if (shape == NULL) continue;
 
         int src_x;
         int src_y;
@@ -470,46 +738,220 @@ void draw(
         int intersection_width;
         int intersection_height;
         bool intersection_is_valid = get_intersection(
-                dest_attr.x, dest_attr.y, dest_attr.width, dest_attr.height,
-                src_attr.x, src_attr.y, src_attr.width, src_attr.height,
+                capture_bounds.x, capture_bounds.y, capture_bounds.width, capture_bounds.height,
+                src_rect.x, src_rect.y, src_rect.width, src_rect.height,
                 &src_x, &src_y, &dest_x, &dest_y,
                 &intersection_width, &intersection_height);
-        if (!intersection_is_valid) continue;
+        if (!intersection_is_valid) {
+            free(shape);
+            continue;
+        }
+        dest_x += capture_bounds.x;
+        dest_y += capture_bounds.y;
 
-        Picture src_pic = XRenderCreatePicture(d, src_w, src_attr.depth == 24 ? format_24 : format_32, 0, NULL);
+        Picture src_pic = composite
+            ? get_window_picture(d, drawn[i], format_32, format_24)
+            : XRenderCreatePicture(d, src_w, depth == 24 ? format_24 : format_32, 0, NULL);
         if (src_pic != None) {
             Pixmap mask = None;
             Picture mask_pic = None;
-            int num_rects = 0;
-            XRectangle *rects = XShapeGetRectangles(d, src_w, ShapeBounding, &num_rects, &dummy_int);
+            int num_rects = xcb_shape_get_rectangles_rectangles_length(shape);
+            xcb_rectangle_t *rects = xcb_shape_get_rectangles_rectangles(shape);
             if (num_rects > 1) {
-                mask = XCreatePixmap(d, root, src_attr.width, src_attr.height, 1);
+                mask = XCreatePixmap(d, root, src_rect.width, src_rect.height, 1);
                 mask_pic = XRenderCreatePicture(d, mask, format_1, 0, NULL);
                 GC mask_gc = XCreateGC(d, mask, 0, NULL);
                 XSetForeground(d, mask_gc, BlackPixel(d, DefaultScreen(d)));
-                XFillRectangle(d, mask, mask_gc, 0, 0, src_attr.width, src_attr.height);
+                XFillRectangle(d, mask, mask_gc, 0, 0, src_rect.width, src_rect.height);
                 XSetForeground(d, mask_gc, WhitePixel(d, DefaultScreen(d)));
                 for (int i = 0; i < num_rects; i++) {
-                    XRectangle rect = rects[i];
+                    xcb_rectangle_t rect = rects[i];
                     XFillRectangle(d, mask, mask_gc, rect.x, rect.y, rect.width, rect.height);
                 }
-                if (rects != NULL) XFree(rects);
                 XFreeGC(d, mask_gc);
             }
 
-            int op = src_attr.depth == 32 ? PictOpOver : PictOpSrc;
-            XRenderComposite(d, op, src_pic, mask_pic, dest_pic, src_x, src_y, src_x, src_y, dest_x, dest_y, intersection_width, intersection_height);
+            int op = depth == 32 ? PictOpOver : PictOpSrc;
+            XRenderComposite(d, op, src_pic, mask_pic, dest_pic, src_x + pic_offset, src_y + pic_offset, src_x, src_y, dest_x, dest_y, intersection_width, intersection_height);
 
-            XRenderFreePicture(d, src_pic);
+            if (!composite) XRenderFreePicture(d, src_pic);
             XRenderFreePicture(d, mask_pic);
             XFreePixmap(d, mask);
         }
+        free(shape);
+        trace_span("composite window", src_w, span_start);
     }
-    if (windows != NULL) XFree(windows);
+    XFixesSetPictureClipRegion(d, dest_pic, 0, 0, None);
+}
+
+// The cursor's image, drawn magnified in full-screen mode in place of the
+// hidden real cursor
+struct cursor_image {
+    Picture picture;
+    int width;
+    int height;
+    int xhot;
+    int yhot;
+};
+
+// Replace the picture in `cursor` with the current cursor image
+static void load_cursor_image(
+        Display *d, Window root, XRenderPictFormat *format_32, struct cursor_image *cursor)
+{
+    if (cursor->picture != None) XRenderFreePicture(d, cursor->picture);
+    cursor->picture = None;
+    XFixesCursorImage *image = XFixesGetCursorImage(d);
+    if (image == NULL) return;
+    if (image->width > 0 && image->height > 0) {
+        // The premultiplied ARGB pixels come as longs, which are wider than
+        // 32 bits on 64-bit machines
+        uint32_t *pixels = malloc(image->width * image->height * sizeof(uint32_t));
+        exit_error_if(pixels == NULL, "Allocating cursor image failed");
+        for (int i = 0; i < image->width * image->height; i++) pixels[i] = image->pixels[i];
+
+        Pixmap pixmap = XCreatePixmap(d, root, image->width, image->height, 32);
+        XImage *x_image = XCreateImage(
+                d, DefaultVisual(d, DefaultScreen(d)), 32, ZPixmap, 0, (char *) pixels,
+                image->width, image->height, 32, 0);
+        GC pixmap_gc = XCreateGC(d, pixmap, 0, NULL);
+        XPutImage(d, pixmap, pixmap_gc, x_image, 0, 0, 0, 0, image->width, image->height);
+        XFreeGC(d, pixmap_gc);
+        // Also frees `pixels`
+        XDestroyImage(x_image);
+        cursor->picture = XRenderCreatePicture(d, pixmap, format_32, 0, NULL);
+        XFreePixmap(d, pixmap);
+
+        cursor->width = image->width;
+        cursor->height = image->height;
+        cursor->xhot = image->xhot;
+        cursor->yhot = image->yhot;
+    }
+    XFree(image);
+}
+
+// Get where the magnified cursor at (`cursor_x`, `cursor_y`) appears over
+// `lens`, where the lens shows that point
+static struct rect get_cursor_rect(
+        const struct cursor_image *cursor, const struct lens *lens, int cursor_x, int cursor_y)
+{
+    if (cursor->picture == None) return (struct rect) { 0 };
+    struct rect output = lens_get_output(lens, cursor_x, cursor_y);
+    int centre_x;
+    int centre_y;
+    lens_get_centre(lens, cursor_x, cursor_y, &centre_x, &centre_y);
+
+    // Rounded the same way as the source offset in `draw_lens()`, so the
+    // cursor stays on the pixel it points at
+    int scaled_centre_x = centre_x * lens->scale;
+    int scaled_centre_y = centre_y * lens->scale;
+    int hot_x = output.x + lens->width / 2 + cursor_x * lens->scale - scaled_centre_x;
+    int hot_y = output.y + lens->height / 2 + cursor_y * lens->scale - scaled_centre_y;
+    return (struct rect) {
+        hot_x - cursor->xhot * lens->scale, hot_y - cursor->yhot * lens->scale,
+        ceil(cursor->width * lens->scale), ceil(cursor->height * lens->scale)
+    };
+}
+
+// Draw the part of the magnified cursor at (`cursor_x`, `cursor_y`) which
+// lies within `clip` over `lens`, where the lens shows that point
+static void draw_cursor(
+        const struct cursor_image *cursor, const struct lens *lens,
+        int cursor_x, int cursor_y, struct rect clip, Picture final_pic, Display *d)
+{
+    if (cursor->picture == None) return;
+    struct rect output = lens_get_output(lens, cursor_x, cursor_y);
+    struct rect rect = get_cursor_rect(cursor, lens, cursor_x, cursor_y);
+    struct rect part;
+    if (!rect_intersect(rect, output, &part) || !rect_intersect(part, clip, &part)) return;
+
+    XFixed scale_f = XDoubleToFixed(1.0 / lens->scale);
+    XFixed one_f = XDoubleToFixed(1.0);
+    XFixed zero_f = XDoubleToFixed(0.0);
+    XTransform scale_transform = {{
+        {scale_f, zero_f, zero_f},
+            {zero_f, scale_f, zero_f},
+            {zero_f, zero_f, one_f}
+    }};
+    XRenderSetPictureTransform(d, cursor->picture, &scale_transform);
+    XRenderComposite(
+            d, PictOpOver, cursor->picture, None, final_pic,
+            part.x - rect.x, part.y - rect.y, 0, 0,
+            part.x, part.y, part.width, part.height);
+}
+
+enum draw_result {
+    // The frame was copied to the window with a single request, so its
+    // completion is signalled by a NoExpose event
+    DRAW_PRESENTED,
+    // The frame was shown in tiles and has already completed
+    DRAW_COMPLETED,
+    // Input arrived part way through showing the frame in tiles, so the rest
+    // of it was dropped
+    DRAW_ABORTED,
+};
+
+// Find the window which is all that could be seen of `area`, if it is opaque
+// and its shape covers `area`. Returns NULL if there is no such window. Whether
+// the shape covers `area` is left to `shape_covers()`.
+static struct indexed_window *get_covering_candidate(
+        struct window_index *window_index, struct rect area)
+{
+    struct indexed_window **windows;
+    unsigned int num_windows = window_index_query(window_index, area, &windows);
+    if (num_windows == 0) return NULL;
+    struct indexed_window *top = windows[num_windows - 1];
+    if (top->depth == 32 || !rect_contains(top->rect, area)) return NULL;
+    return top;
+}
 
-    XCopyArea(d, dest_pixmap, final_pixmap, gc, 0, 0, root_attr.width, root_attr.height, 0, 0);
+// Check whether the bounding shape of `window` covers all of `area`
+static bool shape_covers(
+        const struct indexed_window *window, const xcb_shape_get_rectangles_reply_t *shape,
+        struct rect area)
+{
+    // An unshaped window's bounding shape is a single rectangle around it
+    if (xcb_shape_get_rectangles_rectangles_length(shape) != 1) return false;
+    xcb_rectangle_t rect = xcb_shape_get_rectangles_rectangles(shape)[0];
+    struct rect bounds = {
+        window->rect.x + rect.x, window->rect.y + rect.y, rect.width, rect.height
+    };
+    return rect_contains(bounds, area);
+}
 
-    XFixed scale_f = XDoubleToFixed(1.0 / scale);
+// Draw the part of `lens` and its border which lies within `clip` onto
+// `final_pixmap`. If `window` isn't NULL, the lens is drawn straight from the
+// window's picture instead of from the capture. That is its composite picture
+// if `composite` is set, and a picture of the window itself otherwise.
+static void draw_lens(
+        const struct lens *lens, int cursor_x, int cursor_y, struct rect clip,
+        const struct indexed_window *window, bool composite,
+        Picture dest_pic, struct mipmap *mipmap, Pixmap final_pixmap, Picture final_pic,
+        Display *d, GC gc)
+{
+    struct rect border;
+    if (!rect_intersect(lens_get_border(lens, cursor_x, cursor_y), clip, &border)) return;
+
+    // Lenses which shrink the screen sample the nearest mipmap level
+    // which is at least as large as what they show
+    Picture src_pic = dest_pic;
+    double src_scale = lens->scale;
+    // Where the top left of `src_pic` is on the screen
+    int origin_x = 0;
+    int origin_y = 0;
+    if (window != NULL) {
+        // Composite pixmaps include the window border
+        int pic_offset = composite ? window->border_width : 0;
+        src_pic = window->picture;
+        origin_x = window->rect.x - pic_offset;
+        origin_y = window->rect.y - pic_offset;
+    } else if (lens->scale < 1.0) {
+        int level = mipmap_get_level(mipmap, lens->scale);
+        src_pic = mipmap_get_picture(mipmap, level);
+        src_scale = lens->scale * (1 << level);
+        if (level == 0) XRenderSetPictureFilter(d, dest_pic, FilterBilinear, NULL, 0);
+    }
+
+    XFixed scale_f = XDoubleToFixed(1.0 / src_scale);
     XFixed one_f = XDoubleToFixed(1.0);
     XFixed zero_f = XDoubleToFixed(0.0);
 
@@ -519,31 +961,526 @@ void draw(
             {zero_f, zero_f, one_f}
     }};
 
-    XRenderSetPictureTransform(d, dest_pic, &scale_transform);
+    XRenderSetPictureTransform(d, src_pic, &scale_transform);
 
-    int scaled_cursor_x = cursor_x * scale;
-    int scaled_cursor_y = cursor_y * scale;
-    int half_width = width / 2;
-    int half_height = height / 2;
+    int centre_x;
+    int centre_y;
+    lens_get_centre(lens, cursor_x, cursor_y, &centre_x, &centre_y);
+    int scaled_centre_x = (centre_x - origin_x) * lens->scale;
+    int scaled_centre_y = (centre_y - origin_y) * lens->scale;
 
     XSetForeground(d, gc, BlackPixel(d, DefaultScreen(d)));
-    XFillRectangle(d, final_pixmap, gc, cursor_x - half_width - 2, cursor_y - half_height - 2, width + 4, height + 4);
+    XFillRectangle(d, final_pixmap, gc, border.x, border.y, border.width, border.height);
+
+    // Offsetting the source by as much as the destination keeps every pixel
+    // identical to drawing the whole lens at once
+    struct rect output = lens_get_output(lens, cursor_x, cursor_y);
+    struct rect part;
+    if (rect_intersect(output, clip, &part)) {
+        XRenderComposite(
+                d, PictOpSrc, src_pic, None, final_pic,
+                scaled_centre_x - lens->width / 2 + part.x - output.x,
+                scaled_centre_y - lens->height / 2 + part.y - output.y,
+                0, 0, part.x, part.y, part.width, part.height);
+    }
+    if (window != NULL) {
+        // The window's picture is also used untransformed by `capture()`
+        XTransform identity_transform = {{
+            {one_f, zero_f, zero_f},
+                {zero_f, one_f, zero_f},
+                {zero_f, zero_f, one_f}
+        }};
+        XRenderSetPictureTransform(d, src_pic, &identity_transform);
+    } else if (src_pic == dest_pic && lens->scale < 1.0) {
+        XRenderSetPictureFilter(d, dest_pic, FilterNearest, NULL, 0);
+    }
+}
+
+struct lens_tile {
+    struct rect rect;
+    long priority;
+};
+
+static int compare_tiles(const void *a, const void *b) {
+    long p1 = ((const struct lens_tile *) a)->priority;
+    long p2 = ((const struct lens_tile *) b)->priority;
+    return (p1 > p2) - (p1 < p2);
+}
+
+// Split `bounds` into tiles, ordered so that tiles showing `damage` (in
+// screen coordinates, before magnification) come first, then the tiles
+// nearest the cursor. Returns the number of tiles.
+static int get_lens_tiles(
+        const struct lens *lenses, int num_lenses, int cursor_x, int cursor_y,
+        struct rect bounds, struct rect damage, struct lens_tile *tiles)
+{
+    int tile_size = LENS_TILE_SIZE;
+    int columns;
+    int rows;
+    while (true) {
+        columns = (bounds.width + tile_size - 1) / tile_size;
+        rows = (bounds.height + tile_size - 1) / tile_size;
+        if (columns * rows <= MAX_LENS_TILES) break;
+        tile_size *= 2;
+    }
+
+    // Where the damage appears in each lens
+    struct rect damage_outputs[MAX_LENSES];
+    int num_damage_outputs = 0;
+    for (int i = 0; i < num_lenses; i++) {
+        const struct lens *lens = &lenses[i];
+        struct rect source;
+        if (!rect_intersect(lens_get_source(lens, cursor_x, cursor_y), damage, &source)) continue;
+        struct rect output = lens_get_output(lens, cursor_x, cursor_y);
+        int centre_x;
+        int centre_y;
+        lens_get_centre(lens, cursor_x, cursor_y, &centre_x, &centre_y);
+        int left = floor(output.x + lens->width / 2 + (source.x - centre_x) * lens->scale);
+        int top = floor(output.y + lens->height / 2 + (source.y - centre_y) * lens->scale);
+        int right = ceil(output.x + lens->width / 2 + (source.x + source.width - centre_x) * lens->scale);
+        int bottom = ceil(output.y + lens->height / 2 + (source.y + source.height - centre_y) * lens->scale);
+        damage_outputs[num_damage_outputs++] = (struct rect) { left, top, right - left, bottom - top };
+    }
+
+    int num_tiles = 0;
+    for (int row = 0; row < rows; row++) {
+        for (int column = 0; column < columns; column++) {
+            struct rect tile = {
+                bounds.x + column * tile_size, bounds.y + row * tile_size, tile_size, tile_size
+            };
+            rect_intersect(tile, bounds, &tile);
+
+            long dx = tile.x + tile.width / 2 - cursor_x;
+            long dy = tile.y + tile.height / 2 - cursor_y;
+            long priority = dx * dx + dy * dy;
+            bool is_damaged = false;
+            for (int i = 0; i < num_damage_outputs; i++) {
+                is_damaged |= rect_overlaps(tile, damage_outputs[i]);
+            }
+            if (!is_damaged) priority += 1l << 40;
+            tiles[num_tiles++] = (struct lens_tile) { tile, priority };
+        }
+    }
+    qsort(tiles, num_tiles, sizeof(struct lens_tile), compare_tiles);
+    return num_tiles;
+}
+
+// Check, without blocking or a round trip to the server, whether any input is
+// waiting to be handled.
+// libinput only shows the type of the first queued event, so this can't tell
+// pointer motion from other input without taking the events.
+static bool has_pending_input(struct libinput *li) {
+    if (li == NULL) return false;
+    struct pollfd fd = { .fd = libinput_get_fd(li), .events = POLLIN };
+    if (poll(&fd, 1, 0) > 0) libinput_dispatch(li);
+    return libinput_next_event_type(li) != LIBINPUT_EVENT_NONE;
+}
+
+enum draw_result draw(
+        const struct lens *lenses, int num_lenses, int cursor_x, int cursor_y,
+        Pixmap dest_pixmap, Pixmap final_pixmap,
+        Picture dest_pic, Picture final_pic,
+        XWindowAttributes root_attr, struct window_index *window_index, struct mipmap *mipmap,
+        bool composite, enum capture_mode capture_mode,
+        Pixmap root_background, Window root, Window w, Display *d, GC gc,
+        XRenderPictFormat *format_32, XRenderPictFormat *format_24, XRenderPictFormat *format_1,
+        struct rect damage, struct libinput *li, const struct cursor_image *cursor,
+        bool *bypassed)
+{
+    uint64_t span_start;
+    struct rect screen_rect = { 0, 0, root_attr.width, root_attr.height };
+
+    // Lenses showing nothing but a single opaque window, such as a
+    // full-screen video or game, are drawn straight from that window without
+    // capturing anything for them. While frozen, or drawing from the
+    // previous capture, the lenses must show the capture instead.
+    struct indexed_window *covering[MAX_LENSES] = { NULL };
+    *bypassed = false;
+    if (capture_mode == CAPTURE_LENSES || capture_mode == CAPTURE_ZOOM) {
+        // The shapes of every candidate are asked for before waiting for any
+        span_start = trace_now();
+        xcb_connection_t *c = XGetXCBConnection(d);
+        struct rect covered_sources[MAX_LENSES];
+        xcb_shape_get_rectangles_cookie_t shape_cookies[MAX_LENSES];
+        for (int i = 0; i < num_lenses; i++) {
+            if (lenses[i].scale < 1.0) continue;
+            struct rect source = lens_get_source(&lenses[i], cursor_x, cursor_y);
+            if (!rect_intersect(source, screen_rect, &source)) continue;
+            covering[i] = get_covering_candidate(window_index, source);
+            if (covering[i] == NULL) continue;
+            covered_sources[i] = source;
+            shape_cookies[i] = xcb_shape_get_rectangles(c, covering[i]->id, XCB_SHAPE_SK_BOUNDING);
+        }
+        for (int i = 0; i < num_lenses; i++) {
+            if (covering[i] == NULL) continue;
+            xcb_generic_error_t *error = NULL;
+            xcb_shape_get_rectangles_reply_t *shape =
+                xcb_shape_get_rectangles_reply(c, shape_cookies[i], &error);
+            bool is_covered = shape != NULL && shape_covers(covering[i], shape, covered_sources[i]);
+            free(shape);
+            free(error);
+            // Without compositing, the window is read straight off the screen
+            // as `capture()` does, through a picture made for this frame only
+            if (is_covered && !composite && covering[i]->picture == None) {
+                covering[i]->picture = XRenderCreatePicture(
+                        d, covering[i]->id, covering[i]->depth == 24 ? format_24 : format_32, 0, NULL);
+            }
+            Picture window_pic = !is_covered ? None
+                : composite ? get_window_picture(d, covering[i], format_32, format_24)
+                : covering[i]->picture;
+            if (window_pic != None) {
+                *bypassed = true;
+            } else {
+                covering[i] = NULL;
+            }
+        }
+        trace_span("find covering windows", 0, span_start);
+    }
+
+    // Only the areas magnified by the lenses need to be captured. The capture
+    // for every lens is shared, so overlapping lenses are only captured once.
+    // Lenses which shrink the screen are drawn from the mipmap instead, which
+    // only needs its dirty tiles captured, whatever the capture mode.
+    struct rect sources[MAX_SOURCES];
+    int num_sources = 0;
+    if (capture_mode == CAPTURE_SCREEN) {
+        sources[num_sources++] = screen_rect;
+    } else {
+        int max_runs = (MAX_SOURCES - MAX_LENSES) / num_lenses;
+        for (int i = 0; i < num_lenses; i++) {
+            if (lenses[i].scale >= 1.0) continue;
+            struct rect source = lens_get_source(&lenses[i], cursor_x, cursor_y);
+            num_sources += mipmap_get_dirty(mipmap, source, &sources[num_sources], max_runs);
+        }
+    }
+    // The areas to rebuild the mipmap in come first
+    int num_mipmap_sources = num_sources;
+    if (capture_mode == CAPTURE_LENSES || capture_mode == CAPTURE_ZOOM) {
+        for (int i = 0; i < num_lenses; i++) {
+            struct lens lens = lenses[i];
+            if (covering[i] != NULL) {
+                continue;
+            } else if (capture_mode == CAPTURE_ZOOM && i == 0) {
+                lens.scale = 1.0;
+            } else if (lens.scale < 1.0) {
+                continue;
+            }
+            struct rect source = lens_get_source(&lens, cursor_x, cursor_y);
+            if (!rect_intersect(source, screen_rect, &source)) continue;
+            sources[num_sources++] = source;
+        }
+    }
+    if (num_sources > 0) {
+        struct rect capture_bounds = { 0 };
+        for (int i = 0; i < num_sources; i++) {
+            capture_bounds = rect_bounds(capture_bounds, sources[i]);
+        }
+        capture(
+                sources, num_sources, capture_bounds, dest_pixmap, dest_pic,
+                window_index, composite, root_background, root, d, gc,
+                format_32, format_24, format_1);
+        if (num_mipmap_sources > 0) {
+            span_start = trace_now();
+            mipmap_update(mipmap, d, sources, num_mipmap_sources);
+            trace_span("mipmap update", 0, span_start);
+        }
+    }
 
-    XRenderComposite(d, PictOpSrc, dest_pic, None, final_pic, scaled_cursor_x - half_width, scaled_cursor_y - half_height, 0, 0, cursor_x - half_width, cursor_y - half_height, width, height);
+    // Draw the lenses back to front, so that the first lens ends up on top
+    XRectangle output_rects[MAX_LENSES];
+    struct rect output_bounds = { 0 };
+    for (int i = num_lenses - 1; i >= 0; i--) {
+        struct rect border = lens_get_border(&lenses[i], cursor_x, cursor_y);
+        output_rects[i] = (XRectangle) { border.x, border.y, border.width, border.height };
+        output_bounds = rect_bounds(output_bounds, border);
+    }
 
-    XCopyArea(d, final_pixmap, w, gc, 0, 0, root_attr.width, root_attr.height, 0, 0);
+    // Only the lenses are part of the window, so everything else on the
+    // screen shows through without having to be captured
+    XserverRegion output_region = XFixesCreateRegion(d, output_rects, num_lenses);
+    XFixesSetWindowShapeRegion(d, w, ShapeBounding, 0, 0, output_region);
+    XFixesSetGCClipRegion(d, gc, 0, 0, output_region);
+
+    enum draw_result result;
+    if ((long) output_bounds.width * output_bounds.height <= TILED_LENS_AREA) {
+        span_start = trace_now();
+        for (int i = num_lenses - 1; i >= 0; i--) {
+            draw_lens(&lenses[i], cursor_x, cursor_y, output_bounds, covering[i], composite, dest_pic, mipmap, final_pixmap, final_pic, d, gc);
+        }
+        if (cursor != NULL) {
+            draw_cursor(cursor, &lenses[0], cursor_x, cursor_y, output_bounds, final_pic, d);
+        }
+        trace_span("scale lenses", 0, span_start);
+
+        // Copy all the lenses with a single request so completion is
+        // signalled by a single NoExpose event
+        span_start = trace_now();
+        XCopyArea(d, final_pixmap, w, gc, output_bounds.x, output_bounds.y, output_bounds.width, output_bounds.height, output_bounds.x, output_bounds.y);
+        trace_span("present", 0, span_start);
+        result = DRAW_PRESENTED;
+    } else {
+        // Large lenses take long enough to scale that the cursor may well
+        // have moved on before they are done, so they are drawn and shown a
+        // tile at a time, most important first, giving up on the rest as
+        // soon as there is new input. Passing a NULL `li` means the frame is
+        // always finished.
+        struct lens_tile tiles[MAX_LENS_TILES];
+        int num_tiles = get_lens_tiles(
+                lenses, num_lenses, cursor_x, cursor_y, output_bounds, damage, tiles);
+
+        XSetGraphicsExposures(d, gc, false);
+        result = DRAW_COMPLETED;
+        for (int t = 0; t < num_tiles; t++) {
+            span_start = trace_now();
+            struct rect tile = tiles[t].rect;
+            for (int i = num_lenses - 1; i >= 0; i--) {
+                draw_lens(&lenses[i], cursor_x, cursor_y, tile, covering[i], composite, dest_pic, mipmap, final_pixmap, final_pic, d, gc);
+            }
+            if (cursor != NULL) draw_cursor(cursor, &lenses[0], cursor_x, cursor_y, tile, final_pic, d);
+            // Flushing rather than syncing lets the server draw this tile
+            // while the next is sent, without a round trip per tile
+            XCopyArea(d, final_pixmap, w, gc, tile.x, tile.y, tile.width, tile.height, tile.x, tile.y);
+            XFlush(d);
+            trace_span_arg("present tile", "tile", t, span_start);
+
+            if (t < num_tiles - 1 && has_pending_input(li)) {
+                result = DRAW_ABORTED;
+                break;
+            }
+        }
+        XSetGraphicsExposures(d, gc, true);
+        // A finished frame is only timed and rate limited once the server
+        // has drawn it. A dropped one is followed straight away by the next.
+        if (result == DRAW_COMPLETED) {
+            span_start = trace_now();
+            XSync(d, false);
+            trace_span("wait for completion", 0, span_start);
+        }
+    }
+    XFixesSetGCClipRegion(d, gc, 0, 0, None);
+    XFixesDestroyRegion(d, output_region);
+    if (!composite) {
+        for (int i = 0; i < num_lenses; i++) {
+            if (covering[i] != NULL) release_window_picture(d, covering[i]);
+        }
+    }
+    return result;
+}
+
+// Redraw `lens` only where the magnified cursor was drawn, `*cursor_rect`,
+// and where it is now, from the previous capture. This is all that changes
+// in full-screen mode while the cursor moves without panning the lens.
+// `*cursor_rect` is updated to where the cursor is drawn now.
+static enum draw_result draw_cursor_only(
+        const struct lens *lens, int cursor_x, int cursor_y,
+        const struct cursor_image *cursor, struct rect *cursor_rect,
+        Picture dest_pic, struct mipmap *mipmap, Pixmap final_pixmap, Picture final_pic,
+        Window w, Display *d, GC gc)
+{
+    uint64_t span_start = trace_now();
+    struct rect output = lens_get_output(lens, cursor_x, cursor_y);
+    struct rect rects[2] = { *cursor_rect, get_cursor_rect(cursor, lens, cursor_x, cursor_y) };
+    struct rect bounds = { 0 };
+    for (int i = 0; i < 2; i++) {
+        if (!rect_intersect(rects[i], output, &rects[i])) continue;
+        draw_lens(lens, cursor_x, cursor_y, rects[i], NULL, false, dest_pic, mipmap, final_pixmap, final_pic, d, gc);
+        draw_cursor(cursor, lens, cursor_x, cursor_y, rects[i], final_pic, d);
+        bounds = rect_bounds(bounds, rects[i]);
+    }
+    trace_span("scale cursor", 0, span_start);
+
+    *cursor_rect = rects[1];
+    if (bounds.width <= 0 || bounds.height <= 0) return DRAW_COMPLETED;
+
+    // Everything else in `final_pixmap` is already on the screen, so the
+    // area between the two is copied along with them, with a single request
+    span_start = trace_now();
+    XCopyArea(d, final_pixmap, w, gc, bounds.x, bounds.y, bounds.width, bounds.height, bounds.x, bounds.y);
+    trace_span("present", 0, span_start);
+    return DRAW_PRESENTED;
+}
+
+static void record_event(struct recorder *recorder, struct record record) {
+    if (recorder != NULL) recorder_write(recorder, record);
+}
+
+static struct record window_record(enum record_type type, Window window, struct rect rect) {
+    struct record record = { .type = type, .window = window };
+    record.rect.x = rect.x;
+    record.rect.y = rect.y;
+    record.rect.width = rect.width;
+    record.rect.height = rect.height;
+    return record;
 }
 
-static bool mgnfx(const char *display, const struct opts opts, int *width, int *height, double *scale, int rate) {
+// The requests for what `track_window()` needs to know about a window. Many
+// windows can be queried before waiting for any of the replies.
+struct window_query {
+    Window window;
+    xcb_get_window_attributes_cookie_t attributes;
+    xcb_get_geometry_cookie_t geometry;
+};
+
+static struct window_query query_window(xcb_connection_t *c, Window window) {
+    return (struct window_query) {
+        .window = window,
+        .attributes = xcb_get_window_attributes(c, window),
+        .geometry = xcb_get_geometry(c, window)
+    };
+}
+
+// Start tracking the geometry, stacking and damage of a top-level window,
+// given the replies to `query`
+static void track_window(
+        Display *d, struct window_index *window_index, struct recorder *recorder,
+        struct window_query query)
+{
+    xcb_connection_t *c = XGetXCBConnection(d);
+    xcb_generic_error_t *attributes_error = NULL;
+    xcb_generic_error_t *geometry_error = NULL;
+    xcb_get_window_attributes_reply_t *attributes =
+        xcb_get_window_attributes_reply(c, query.attributes, &attributes_error);
+    xcb_get_geometry_reply_t *geometry =
+        xcb_get_geometry_reply(c, query.geometry, &geometry_error);
+    free(attributes_error);
+    free(geometry_error);
+
+    // The window may already have been destroyed, or already be tracked if
+    // it was created while the initial layout was being scanned
+    Window window = query.window;
+    if (attributes != NULL && geometry != NULL && window_index_get(window_index, window) == NULL) {
+        struct rect rect = { geometry->x, geometry->y, geometry->width, geometry->height };
+        bool viewable = attributes->map_state == XCB_MAP_STATE_VIEWABLE;
+        window_index_add(window_index, window, rect, geometry->depth, viewable);
+        struct indexed_window *indexed = window_index_get(window_index, window);
+        indexed->border_width = geometry->border_width;
+        indexed->damage = XDamageCreate(d, window, XDamageReportRawRectangles);
+
+        struct record record = window_record(RECORD_CREATE, window, rect);
+        record.code = geometry->depth;
+        record.flag = viewable;
+        record_event(recorder, record);
+    }
+    free(attributes);
+    free(geometry);
+}
+
+static void untrack_window(
+        Display *d, struct window_index *window_index, struct recorder *recorder, Window window)
+{
+    struct indexed_window *indexed = window_index_get(window_index, window);
+    if (indexed == NULL) return;
+    release_window_picture(d, indexed);
+    // A window reparented away from the root lives on, and so would its
+    // damage object. The server has already freed the damage of a destroyed
+    // window, and the error for destroying it again is ignored.
+    XDamageDestroy(d, indexed->damage);
+    window_index_remove(window_index, window);
+    record_event(recorder, (struct record) { .type = RECORD_DESTROY, .window = window });
+}
+
+// Convert a libinput event into a record of the parts of it the render loop
+// uses. Returns false for events which aren't used.
+static bool record_from_libinput(struct libinput_event *li_ev, struct record *record) {
+    *record = (struct record) { 0 };
+    switch (libinput_event_get_type(li_ev)) {
+        case LIBINPUT_EVENT_KEYBOARD_KEY:
+            struct libinput_event_keyboard *li_ev_key = libinput_event_get_keyboard_event(li_ev);
+            record->type = RECORD_KEY;
+            record->code = libinput_event_keyboard_get_key(li_ev_key);
+            record->flag = libinput_event_keyboard_get_key_state(li_ev_key);
+            return true;
+        case LIBINPUT_EVENT_POINTER_MOTION:
+            struct libinput_event_pointer *li_ev_motion = libinput_event_get_pointer_event(li_ev);
+            record->type = RECORD_MOTION;
+            record->motion.dx = libinput_event_pointer_get_dx(li_ev_motion);
+            record->motion.dy = libinput_event_pointer_get_dy(li_ev_motion);
+            record->time_us = libinput_event_pointer_get_time_usec(li_ev_motion);
+            return true;
+        case LIBINPUT_EVENT_POINTER_BUTTON:
+            struct libinput_event_pointer *li_ev_button = libinput_event_get_pointer_event(li_ev);
+            record->type = RECORD_BUTTON;
+            record->code = libinput_event_pointer_get_button(li_ev_button);
+            record->flag = libinput_event_pointer_get_button_state(li_ev_button);
+            return true;
+        case LIBINPUT_EVENT_POINTER_AXIS:
+            struct libinput_event_pointer *li_ev_axis = libinput_event_get_pointer_event(li_ev);
+            record->type = RECORD_AXIS;
+            record->motion.dy = libinput_event_pointer_get_axis_value(li_ev_axis, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL);
+            return true;
+        case LIBINPUT_EVENT_GESTURE_PINCH_BEGIN:
+            record->type = RECORD_PINCH;
+            record->flag = RECORD_PINCH_BEGIN;
+            return true;
+        case LIBINPUT_EVENT_GESTURE_PINCH_UPDATE:
+        case LIBINPUT_EVENT_GESTURE_PINCH_END:
+            struct libinput_event_gesture *li_ev_gesture = libinput_event_get_gesture_event(li_ev);
+            record->type = RECORD_PINCH;
+            if (libinput_event_get_type(li_ev) == LIBINPUT_EVENT_GESTURE_PINCH_UPDATE) {
+                record->flag = RECORD_PINCH_UPDATE;
+                record->motion.dx = libinput_event_gesture_get_scale(li_ev_gesture);
+            } else {
+                // A cancelled pinch goes back to where it started
+                record->flag = RECORD_PINCH_END;
+                record->motion.dx = libinput_event_gesture_get_cancelled(li_ev_gesture)
+                    ? 1.0 : libinput_event_gesture_get_scale(li_ev_gesture);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Get the next input event, either from libinput or from the replay
+static bool next_input(struct libinput *li, struct replay *replay, struct record *record) {
+    if (replay != NULL) return replay_next_input(replay, record);
+    struct libinput_event *li_ev;
+    while ((li_ev = libinput_get_event(li)) != NULL) {
+        bool is_used = record_from_libinput(li_ev, record);
+        libinput_event_destroy(li_ev);
+        if (is_used) return true;
+    }
+    return false;
+}
+
+// Publish the current contents of every lens to the frame export ring
+static void publish_lenses(
+        struct frame_export *export, Display *d, Pixmap final_pixmap,
+        const struct lens *lenses, int num_lenses, int cursor_x, int cursor_y)
+{
+    struct rect outputs[MAX_LENSES];
+    double zooms[MAX_LENSES];
+    for (int i = 0; i < num_lenses; i++) {
+        outputs[i] = lens_get_output(&lenses[i], cursor_x, cursor_y);
+        zooms[i] = lenses[i].scale;
+    }
+    frame_export_publish(export, d, final_pixmap, outputs, zooms, num_lenses);
+}
+
+// `lenses[0]` follows the cursor and is the lens controlled by the key and
+// mouse bindings. Any further lenses are docked.
+// If recording, `*recorder` is created on the first call. If `replay` isn't
+// NULL, input comes from it instead of libinput.
+static bool mgnfx(
+        const char *display, const struct opts opts, struct lens *lenses, int num_lenses, int rate,
+        struct recorder **recorder_ptr, struct replay *replay)
+{
+    struct lens *cursor_lens = &lenses[0];
+
     // Setup getting events from libinput
-    char *seat = getenv("XDG_SEAT");
-    if (seat == NULL) exit_error("`XDG_SEAT` environment variable is not set");
-    struct udev *udev = udev_new();
-    struct libinput *li = libinput_udev_create_context(
-            &li_interface, NULL, udev);
-    libinput_udev_assign_seat(li, seat);
-    libinput_dispatch(li);
-    int li_fd = libinput_get_fd(li);
+    struct udev *udev = NULL;
+    struct libinput *li = NULL;
+    int li_fd = -1;
+    if (replay == NULL) {
+        char *seat = getenv("XDG_SEAT");
+        if (seat == NULL) exit_error("`XDG_SEAT` environment variable is not set");
+        udev = udev_new();
+        li = libinput_udev_create_context(
+                &li_interface, NULL, udev);
+        libinput_udev_assign_seat(li, seat);
+        libinput_dispatch(li);
+        li_fd = libinput_get_fd(li);
+    }
 
     // An int to pass as a fishing pointer to functions which will fail if
     // we pass NULL in cases where we don't care about the returned value
@@ -583,29 +1520,61 @@ static bool mgnfx(const char *display, const struct opts opts, int *width, int *
     // not read any uninitialized memory
     assert((long unsigned int) ATOM_SIZE <= sizeof(Atom) * 8);
 
-    // Ensure all required X extensions are available
-    bool has_all_extensions = true;
+    // Ensure all required X extensions are available, with a clear message
+    // for any that aren't. This check is a round trip of its own: each
+    // extension's library still queries the server for it on first use.
     const char *required_extensions[] = {
         DAMAGE_NAME,
         SHAPENAME,
         XFIXES_NAME,
-        SHAPENAME,
         COMPOSITE_NAME,
         RENDER_NAME,
         RANDR_NAME
     };
     int num_extensions =
         sizeof(required_extensions) / sizeof(required_extensions[0]);
-    for (int i = 0; i < num_extensions; i++) {
-        has_all_extensions &= has_extension(d, required_extensions[i]);
-    }
-    if (!has_all_extensions) {
+    uint64_t setup_span_start = trace_now();
+    if (!has_extensions(d, required_extensions, num_extensions)) {
         exit_error("A required X extension is unavailable");
     }
-    // Initialize all the required extensions
-    for (int i = 0; i < num_extensions; i++) {
-        init_extension(d, required_extensions[i]);
-    }
+    trace_span("check extensions", 0, setup_span_start);
+
+    // Intern every atom needed from here on at once
+    char cm_selection_name[32];
+    snprintf(cm_selection_name, sizeof(cm_selection_name), "_NET_WM_CM_S%d", screen);
+    char *state_names[] = {
+        "_NET_WM_STATE_ABOVE",
+        "_NET_WM_STATE_STAYS_ON_TOP",
+        "_NET_WM_STATE_SKIP_TASKBAR",
+        "_NET_WM_STATE_SKIP_PAGER",
+        "_NET_WM_STATE_STICKY"
+    };
+    int num_state_names = sizeof(state_names) / sizeof(state_names[0]);
+    Atom state_atoms[sizeof(state_names) / sizeof(state_names[0])];
+    Atom ewmh_name;
+    Atom utf8_string;
+    Atom window_type;
+    Atom window_type_utility;
+    Atom ewmh_state;
+    Atom cm_selection;
+    Atom root_pixmap_atom;
+    struct atom_request atom_requests[] = {
+        { "_NET_WM_NAME", &ewmh_name, false },
+        { "UTF8_STRING", &utf8_string, false },
+        { "_NET_WM_WINDOW_TYPE", &window_type, false },
+        { "_NET_WM_WINDOW_TYPE_UTILITY", &window_type_utility, false },
+        { "_NET_WM_STATE", &ewmh_state, false },
+        { cm_selection_name, &cm_selection, opts.composite },
+        { "_XROOTPMAP_ID", &root_pixmap_atom, false },
+        { state_names[0], &state_atoms[0], false },
+        { state_names[1], &state_atoms[1], false },
+        { state_names[2], &state_atoms[2], false },
+        { state_names[3], &state_atoms[3], false },
+        { state_names[4], &state_atoms[4], false }
+    };
+    setup_span_start = trace_now();
+    intern_atoms(d, atom_requests, sizeof(atom_requests) / sizeof(atom_requests[0]));
+    trace_span("intern atoms", 0, setup_span_start);
 
     GC gc = DefaultGC(d, screen);
 
@@ -620,18 +1589,12 @@ static bool mgnfx(const char *display, const struct opts opts, int *width, int *
             0, CopyFromParent, CopyFromParent, CopyFromParent,
             attr_mask, &WindowAttributes);
 
-    Atom atom = get_atom_not_none(d, "ATOM");
-    Atom string = get_atom_not_none(d, "STRING");
-
     // Set the 'window name' property
-    Atom name = get_atom_not_none(d, "WM_NAME");
     XChangeProperty(
-            d, w, name, string, 8, PropModeReplace,
+            d, w, XA_WM_NAME, XA_STRING, 8, PropModeReplace,
             WINDOW_TITLE_BYTES, sizeof(WINDOW_TITLE_BYTES) - 1);
 
     // Set the EWMH 'window name' property
-    Atom ewmh_name = XInternAtom(d, "_NET_WM_NAME", true);
-    Atom utf8_string = XInternAtom(d, "UTF8_STRING", true);
     if (ewmh_name != None && utf8_string != None) {
         XChangeProperty(
                 d, w, ewmh_name, utf8_string, 8, PropModeReplace,
@@ -639,36 +1602,22 @@ static bool mgnfx(const char *display, const struct opts opts, int *width, int *
     }
 
     // Set the EWMH 'window type' property
-    Atom window_type = XInternAtom(d, "_NET_WM_WINDOW_TYPE", true);
-    Atom window_type_utility = XInternAtom(
-            d, "_NET_WM_WINDOW_TYPE_UTILITY", true);
     if (window_type != None && window_type_utility != None) {
         XChangeProperty(
-                d, w, window_type, atom, ATOM_SIZE, PropModeReplace,
+                d, w, window_type, XA_ATOM, ATOM_SIZE, PropModeReplace,
                 (unsigned char *) &window_type_utility, 1);
     }
 
     // Set EWMH 'window state' properties
-    Atom ewmh_state = XInternAtom(d, "_NET_WM_STATE", true);
     if (ewmh_state != None) {
-        char *state_names[] = {
-            "_NET_WM_STATE_ABOVE",
-            "_NET_WM_STATE_STAYS_ON_TOP",
-            "_NET_WM_STATE_SKIP_TASKBAR",
-            "_NET_WM_STATE_SKIP_PAGER",
-            "_NET_WM_STATE_STICKY"
-        };
-        int num_state_names = sizeof(state_names) / sizeof(state_names[0]);
-
         XChangeProperty(
-                d, w, ewmh_state, atom, ATOM_SIZE, PropModeReplace,
+                d, w, ewmh_state, XA_ATOM, ATOM_SIZE, PropModeReplace,
                 NULL, 0);
         for (int i = 0; i < num_state_names; i++) {
-            Atom state_atom = XInternAtom(d, state_names[i], true);
-            if (state_atom != None) {
+            if (state_atoms[i] != None) {
                 XChangeProperty(
-                        d, w, ewmh_state, atom, ATOM_SIZE, PropModeAppend,
-                        (unsigned char *) &state_atom, 1);
+                        d, w, ewmh_state, XA_ATOM, ATOM_SIZE, PropModeAppend,
+                        (unsigned char *) &state_atoms[i], 1);
             }
         }
     }
@@ -685,11 +1634,60 @@ static bool mgnfx(const char *display, const struct opts opts, int *width, int *
     // We want to know about substructure events because these tell us when new
     // windows are created, raised, fullscreened, etc. and let us keep our
     // magnifier window on top when this happens.
-    XSelectInput(d, root, SubstructureNotifyMask | StructureNotifyMask);
+    // Property changes on the root window tell us when the wallpaper changes.
+    XSelectInput(d, root, SubstructureNotifyMask | StructureNotifyMask | PropertyChangeMask);
+    // The wallpaper is only read again when its property changes, rather
+    // than with a round trip for every capture
+    Pixmap root_background = get_root_background_pixmap(d, root, root_pixmap_atom);
+
+    // In composite mode windows are captured from their composite pixmaps,
+    // which hold their full contents even where they are covered or
+    // offscreen. A running compositing manager has already redirected the
+    // windows; otherwise we have the server do it.
+    bool redirected = false;
+    if (opts.composite) {
+        if (XGetSelectionOwner(d, cm_selection) == None) {
+            XCompositeRedirectSubwindows(d, root, CompositeRedirectAutomatic);
+            redirected = true;
+        }
+    }
+
+    // Records made until the initial layout has been tracked describe the
+    // layout rather than changes to it
+    if (opts.record_path != NULL && *recorder_ptr == NULL) {
+        *recorder_ptr = recorder_create(opts.record_path, root_attr.width, root_attr.height);
+    }
+    struct recorder *recorder = *recorder_ptr;
+    if (replay != NULL) replay_start(replay, display);
+
     int damage_event_base;
     XDamageQueryExtension(d, &damage_event_base, &dummy_int);
     int damage_notify_event = damage_event_base + XDamageNotify;
-    Damage damage = XDamageCreate(d, root, XDamageReportRawRectangles);
+    // Damage is tracked on each top-level window rather than on the root
+    // window, so that drawing the lenses never reports damage back to us.
+    // The geometry and stacking of the top-level windows is kept up to date
+    // from substructure events. Windows created later are tracked when their
+    // CreateNotify arrives.
+    // All the windows are queried before waiting for any of the replies, so
+    // that startup takes the same two round trips however many there are.
+    setup_span_start = trace_now();
+    struct window_index *window_index = window_index_create(root_attr.width, root_attr.height);
+    xcb_connection_t *c = XGetXCBConnection(d);
+    xcb_query_tree_reply_t *tree = xcb_query_tree_reply(c, xcb_query_tree(c, root), NULL);
+    exit_error_if(tree == NULL, "Querying the top-level windows failed");
+    xcb_window_t *top_levels = xcb_query_tree_children(tree);
+    int num_top_levels = xcb_query_tree_children_length(tree);
+    struct window_query *top_level_queries = calloc(num_top_levels, sizeof(struct window_query));
+    exit_error_if(top_level_queries == NULL && num_top_levels > 0, "Allocating window queries failed");
+    for (int i = 0; i < num_top_levels; i++) {
+        if (top_levels[i] != w) top_level_queries[i] = query_window(c, top_levels[i]);
+    }
+    for (int i = 0; i < num_top_levels; i++) {
+        if (top_levels[i] != w) track_window(d, window_index, recorder, top_level_queries[i]);
+    }
+    free(top_level_queries);
+    free(tree);
+    trace_span_arg("scan windows", "windows", num_top_levels, setup_span_start);
     int rr_event_base;
     XRRQueryExtension(d, &rr_event_base, &dummy_int);
     int screen_change_notify_event = rr_event_base + RRScreenChangeNotify;
@@ -719,234 +1717,598 @@ static bool mgnfx(const char *display, const struct opts opts, int *width, int *
     Picture final_pic = XRenderCreatePicture(d, final_pixmap, format_24, 0, NULL);
     if (final_pic == None) exit_error("Creating final XRender picture failed");
 
+    // The full-screen lens never zooms below 1, so needs no smaller levels
+    double min_scale = opts.fullscreen ? 1.0 : MIN_SCALE;
+    struct mipmap *mipmap = mipmap_create(
+            d, root, dest_pic, root_attr.width, root_attr.height, root_attr.depth,
+            format_24, min_scale);
+
+    struct frame_export *export = NULL;
+    if (opts.export_path != NULL) {
+        // The cursor lens can grow to cover the whole screen, while docked
+        // lenses stay where they are
+        struct rect screen_rect = { 0, 0, root_attr.width, root_attr.height };
+        struct rect export_bounds[MAX_LENSES] = { screen_rect };
+        for (int i = 1; i < num_lenses; i++) {
+            if (!rect_intersect(lens_get_output(&lenses[i], 0, 0), screen_rect, &export_bounds[i])) {
+                export_bounds[i] = (struct rect) { 0 };
+            }
+        }
+        export = frame_export_create(d, opts.export_path, export_bounds, num_lenses);
+    }
+
     // Setup polling
     struct pollfd pollfds[] = {
         { .fd = d_fd, .events = POLLIN },
         { .fd = li_fd, .events = POLLIN }
     };
-    int num_fds = sizeof(pollfds) / sizeof(pollfds[0]);
+    int num_fds = replay == NULL ? sizeof(pollfds) / sizeof(pollfds[0]) : 1;
 
-    struct pollfd *x_pollfd = &pollfds[0];
     struct pollfd *li_pollfd = &pollfds[1];
 
     // Show the window
+    // The window starts out empty and is shaped to the lenses by `draw()`
+    XserverRegion empty_region = XFixesCreateRegion(d, NULL, 0);
+    XFixesSetWindowShapeRegion(d, w, ShapeBounding, 0, 0, empty_region);
+    XFixesDestroyRegion(d, empty_region);
     XMapWindow(d, w);
-    // Put the screen contents on the window initially
-    XCopyArea(d, root, w, gc, 0, 0, root_attr.width, root_attr.height, 0, 0);
-
-    XWindowAttributes dest_attr;
-    XGetWindowAttributes(d, w, &dest_attr);
 
     int cursor_x = 0;
     int cursor_y = 0;
     get_cursor_position(d, root, &cursor_x, &cursor_y);
     unsigned int modifiers_held = 0;
 
+    // Where the cursor lens is centred, which is ahead of the cursor when
+    // predicting
+    int lens_x = cursor_x;
+    int lens_y = cursor_y;
+    struct predictor predictor;
+    predictor_init(&predictor);
+
+    // In full-screen mode the cursor lens is docked over the whole screen
+    // and its source is panned to follow the cursor. The real cursor would
+    // be in the wrong place over the magnified screen, so it is hidden and a
+    // magnified copy is drawn where it points instead.
+    struct cursor_image cursor_image = { None };
+    int fixes_event_base;
+    XFixesQueryExtension(d, &fixes_event_base, &dummy_int);
+    int cursor_notify_event = fixes_event_base + XFixesCursorNotify;
+    if (opts.fullscreen) {
+        load_cursor_image(d, root, format_32, &cursor_image);
+        XFixesSelectCursorInput(d, root, XFixesDisplayCursorNotifyMask);
+        XFixesHideCursor(d, root);
+
+        cursor_lens->docked = true;
+        cursor_lens->x = 0;
+        cursor_lens->y = 0;
+        cursor_lens->width = root_attr.width;
+        cursor_lens->height = root_attr.height;
+        cursor_lens->src_x = cursor_x;
+        cursor_lens->src_y = cursor_y;
+        lens_pan(cursor_lens, lens_x, lens_y, opts.edge_margin, root_attr.width, root_attr.height);
+    }
+
+    struct record cursor_record = { .type = RECORD_CURSOR };
+    cursor_record.rect.x = cursor_x;
+    cursor_record.rect.y = cursor_y;
+    record_event(recorder, cursor_record);
+    if (recorder != NULL) recorder_start(recorder);
+
+    // Whether the last frame drew any lens straight from a window
+    bool bypassed;
     draw(
-            *width, *height, *scale, cursor_x, cursor_y,
+            lenses, num_lenses, lens_x, lens_y,
             dest_pixmap, final_pixmap,
-            dest_pic, final_pic, root_attr, dest_attr, root, w, d, gc,
-            format_32, format_24, format_1);
+            dest_pic, final_pic, root_attr, window_index, mipmap, opts.composite, CAPTURE_LENSES,
+            root_background, root, w, d, gc, format_32, format_24, format_1,
+            (struct rect) { 0 }, NULL, opts.fullscreen ? &cursor_image : NULL, &bypassed);
     XFlush(d);
+    // Where the magnified cursor was last drawn in full-screen mode
+    struct rect cursor_rect = get_cursor_rect(&cursor_image, cursor_lens, lens_x, lens_y);
+    if (export != NULL) {
+        publish_lenses(
+                export, d, final_pixmap, lenses, num_lenses, lens_x, lens_y);
+    }
+
+    // Everything the render loop needs has been allocated by now
+    if (opts.lock_memory) realtime_lock_memory();
+
+    // While frozen, the lenses are drawn from a capture of the whole screen
+    // taken when freezing, and nothing is captured
+    bool frozen = false;
+    bool capture_screen = false;
+
+    // Zoom changes set a target which the cursor lens's zoom moves towards
+    // a little every frame. While zooming, the cursor lens's source is
+    // captured at a zoom of 1, and frames which only change the zoom reuse
+    // that capture.
+    double target_scale = cursor_lens->scale;
+    bool pinching = false;
+    double pinch_start_scale = target_scale;
+    struct rect zoom_capture = { 0 };
+    bool zoom_capture_valid = false;
 
     bool input_grabbed = false;
     bool mouse_held = false;
     int click_x;
     int click_y;
 
+    // Whether the last frame was dropped part way through for being stale
+    bool restart_frame = false;
+
     bool keep_looping = true;
     bool should_exit = false;
     while (keep_looping) {
-        poll(pollfds, num_fds, -1);
+        trace_begin_frame();
+
+        // Events may already have been read into Xlib's queue, in which case
+        // the socket won't become readable for them
+        uint64_t span_start = trace_now();
+        bool animating = cursor_lens->scale != target_scale;
+        int timeout = XQLength(d) > 0 || animating || restart_frame ? 0
+            : replay != NULL ? replay_timeout(replay)
+            : -1;
+        poll(pollfds, num_fds, timeout);
+        trace_span("poll", 0, span_start);
 
         struct timespec prev_time;
         struct timespec time;
 
-        clock_gettime(CLOCK_MONOTONIC_RAW, &prev_time);
+        clock_gettime(CLOCK_MONOTONIC, &prev_time);
 
         bool has_damage = false;
-        bool has_input = false;
-
-        bool got_cursor_position = get_cursor_position(d, root, &cursor_x, &cursor_y);
+        // The area of the screen damaged since the last frame, which large
+        // lenses draw first
+        struct rect damage_bounds = { 0 };
+        // A dropped frame leaves the lenses partly drawn. The frame replacing
+        // it is always finished, so that the lenses keep up with a pointer
+        // which never stops moving for long.
+        bool has_input = restart_frame;
+        bool must_finish = restart_frame;
+        restart_frame = false;
+        bool has_zoom = false;
+        // Whether the cursor moved or changed its image. In full-screen mode
+        // that alone only needs the cursor redrawn.
+        bool cursor_changed = false;
+
+        int prev_cursor_x = cursor_x;
+        int prev_cursor_y = cursor_y;
+        uint64_t cursor_time = get_time_ns();
+        // While frozen, damage is ignored, so waking up for it alone isn't
+        // worth the round trip of querying the pointer. The pointer only
+        // moves along with input events, other than when it is warped.
+        bool has_pending_li_events = li != NULL
+            && ((li_pollfd->revents & POLLIN) || libinput_next_event_type(li) != LIBINPUT_EVENT_NONE);
+        bool got_cursor_position = true;
+        if (!frozen || has_pending_li_events || replay != NULL || animating || has_input) {
+            got_cursor_position = get_cursor_position(d, root, &cursor_x, &cursor_y);
+        }
+        // The cursor also moves without relative motion events, such as
+        // from tablets, touchscreens and warps, so the lens follows wherever
+        // it is rather than the events
+        if (cursor_x != prev_cursor_x || cursor_y != prev_cursor_y) {
+            cursor_changed = true;
+            cursor_record.rect.x = cursor_x;
+            cursor_record.rect.y = cursor_y;
+            record_event(recorder, cursor_record);
+        }
 
-        // If there are new events from libinput
-        if (li_pollfd->revents & POLLIN) {
-            has_input = true;
+        // If there are new input events
+        span_start = trace_now();
+        if (replay != NULL) {
+            replay_apply(replay);
+        } else if (li_pollfd->revents & POLLIN) {
             libinput_dispatch(li);
-            struct libinput_event *li_ev;
-            while ((li_ev = libinput_get_event(li)) != NULL) {
-                switch (libinput_event_get_type(li_ev)) {
-                    case LIBINPUT_EVENT_POINTER_MOTION:
-                        if (!input_grabbed) break;
-                        if (mouse_held && got_cursor_position) {
-                            *width = abs(cursor_x - click_x) * 2;
-                            *height = abs(cursor_y - click_y) * 2;
-                        }
-                        break;
-                    case LIBINPUT_EVENT_POINTER_BUTTON:
-                        if (!input_grabbed) break;
-                        struct libinput_event_pointer *li_ev_pointer =
-                            libinput_event_get_pointer_event(li_ev);
-                        uint32_t button = libinput_event_pointer_get_button(li_ev_pointer);
-                        enum libinput_button_state button_state = libinput_event_pointer_get_button_state(li_ev_pointer);
-                        if (button == BTN_LEFT) {
-                            switch (button_state) {
-                                case LIBINPUT_BUTTON_STATE_PRESSED:
-                                    if (got_cursor_position) {
-                                        mouse_held = true;
-                                        click_x = cursor_x;
-                                        click_y = cursor_y;
-                                    }
-                                    break;
-                                case LIBINPUT_BUTTON_STATE_RELEASED:
-                                    mouse_held = false;
-                                    break;
-                            }
-                        }
-                        break;
-                    case LIBINPUT_EVENT_KEYBOARD_KEY:
-                        struct libinput_event_keyboard *li_ev_key =
-                            libinput_event_get_keyboard_event(li_ev);
-                        uint32_t keycode =
-                            libinput_event_keyboard_get_key(li_ev_key);
-                        enum libinput_key_state state =
-                            libinput_event_keyboard_get_key_state(li_ev_key);
-                        int modifier = -1;
-                        for (unsigned int i = 0; i < opts.num_modifier_keys; i++) {
-                            if (keycode == opts.modifier_keys[i]) {
-                                modifier = i;
+        }
+        struct record input;
+        while (next_input(li, replay, &input)) {
+            record_event(recorder, input);
+            switch (input.type) {
+                case RECORD_MOTION:
+                    cursor_changed = true;
+                    if (opts.predict) {
+                        predictor_motion(&predictor, input.time_us, input.motion.dx, input.motion.dy);
+                    }
+                    if (!input_grabbed) break;
+                    if (mouse_held && got_cursor_position) {
+                        cursor_lens->width = abs(cursor_x - click_x) * 2;
+                        cursor_lens->height = abs(cursor_y - click_y) * 2;
+                    }
+                    break;
+                case RECORD_BUTTON:
+                    if (!input_grabbed) break;
+                    has_input = true;
+                    uint32_t button = input.code;
+                    enum libinput_button_state button_state = input.flag;
+                    if (button == BTN_LEFT) {
+                        switch (button_state) {
+                            case LIBINPUT_BUTTON_STATE_PRESSED:
+                                if (got_cursor_position) {
+                                    mouse_held = true;
+                                    click_x = cursor_x;
+                                    click_y = cursor_y;
+                                }
                                 break;
-                            }
+                            case LIBINPUT_BUTTON_STATE_RELEASED:
+                                mouse_held = false;
+                                break;
+                        }
+                    }
+                    break;
+                case RECORD_KEY:
+                    uint32_t keycode = input.code;
+                    enum libinput_key_state state = input.flag;
+                    int modifier = -1;
+                    for (unsigned int i = 0; i < opts.num_modifier_keys; i++) {
+                        if (keycode == opts.modifier_keys[i]) {
+                            modifier = i;
+                            break;
                         }
-                        switch (state) {
-                            case LIBINPUT_KEY_STATE_PRESSED:
-                                if (modifier != -1) {
-                                    modifiers_held++;
-                                    bool all_modifiers_held = modifiers_held == opts.num_modifier_keys;
-                                    if (all_modifiers_held) {
-                                        input_grabbed =
-                                            XGrabPointer(d, w, true, NoEventMask, GrabModeAsync, GrabModeAsync, None, None, CurrentTime) == GrabSuccess
-                                            && XGrabKeyboard(d, w, true, GrabModeAsync, GrabModeAsync, CurrentTime) == GrabSuccess;
-                                        if (!input_grabbed) {
-                                            XUngrabPointer(d, CurrentTime);
-                                            XUngrabKeyboard(d, CurrentTime);
-                                        }
+                    }
+                    switch (state) {
+                        case LIBINPUT_KEY_STATE_PRESSED:
+                            if (modifier != -1) {
+                                modifiers_held++;
+                                bool all_modifiers_held = modifiers_held == opts.num_modifier_keys;
+                                if (all_modifiers_held) {
+                                    input_grabbed =
+                                        XGrabPointer(d, w, true, NoEventMask, GrabModeAsync, GrabModeAsync, None, None, CurrentTime) == GrabSuccess
+                                        && XGrabKeyboard(d, w, true, GrabModeAsync, GrabModeAsync, CurrentTime) == GrabSuccess;
+                                    if (!input_grabbed) {
+                                        XUngrabPointer(d, CurrentTime);
+                                        XUngrabKeyboard(d, CurrentTime);
                                     }
                                 }
-                                break;
-                            case LIBINPUT_KEY_STATE_RELEASED:
-                                if (modifier != -1) {
-                                    modifiers_held = 0;
-                                    XUngrabPointer(d, CurrentTime);
-                                    XUngrabKeyboard(d, CurrentTime);
-                                    input_grabbed = false;
-                                } else if (keycode == opts.quit_key) {
-                                    keep_looping = false;
-                                    should_exit = true;
-                                }
-                                if (input_grabbed) {
-                                    if (keycode == opts.grow_width_key) {
-                                        *width = int_min(*width + opts.width_step, root_attr.width);
-                                    } else if (keycode == opts.shrink_width_key) {
-                                        *width = int_max(*width - opts.width_step, 1);
-                                    } else if (keycode == opts.grow_height_key) {
-                                        *height = int_min(*height + opts.height_step, root_attr.height);
-                                    } else if (keycode == opts.shrink_height_key) {
-                                        *height = int_max(*height - opts.height_step, 1);
-                                    } else if (keycode == opts.zoom_in_key) {
-                                        *scale += opts.zoom_step;
-                                        if (*scale > MAX_SCALE) *scale = MAX_SCALE;
-                                    } else if (keycode == opts.zoom_out_key) {
-                                        *scale -= opts.zoom_step;
-                                        if (*scale < MIN_SCALE) *scale = MIN_SCALE;
-                                    }
+                            }
+                            break;
+                        case LIBINPUT_KEY_STATE_RELEASED:
+                            if (modifier != -1) {
+                                modifiers_held = 0;
+                                XUngrabPointer(d, CurrentTime);
+                                XUngrabKeyboard(d, CurrentTime);
+                                input_grabbed = false;
+                            } else if (keycode == opts.quit_key) {
+                                keep_looping = false;
+                                should_exit = true;
+                            }
+                            if (input_grabbed) {
+                                has_input = true;
+                                if (keycode == opts.grow_width_key) {
+                                    cursor_lens->width = int_min(cursor_lens->width + opts.width_step, root_attr.width);
+                                } else if (keycode == opts.shrink_width_key) {
+                                    cursor_lens->width = int_max(cursor_lens->width - opts.width_step, 1);
+                                } else if (keycode == opts.grow_height_key) {
+                                    cursor_lens->height = int_min(cursor_lens->height + opts.height_step, root_attr.height);
+                                } else if (keycode == opts.shrink_height_key) {
+                                    cursor_lens->height = int_max(cursor_lens->height - opts.height_step, 1);
+                                } else if (keycode == opts.zoom_in_key) {
+                                    target_scale = clamp_scale(min_scale, target_scale + opts.zoom_step);
+                                } else if (keycode == opts.zoom_out_key) {
+                                    target_scale = clamp_scale(min_scale, target_scale - opts.zoom_step);
+                                } else if (keycode == opts.freeze_key) {
+                                    frozen = !frozen;
+                                    capture_screen = frozen;
+                                    // Damage was ignored while frozen
+                                    if (!frozen) mipmap_damage_all(mipmap);
                                 }
-                                break;
-                        }
-                        break;
-                    case LIBINPUT_EVENT_POINTER_AXIS:
-                        if (input_grabbed) {
-                            struct libinput_event_pointer *li_ev_axis =
-                                libinput_event_get_pointer_event(li_ev);
-                            double scroll = libinput_event_pointer_get_axis_value(li_ev_axis, LIBINPUT_POINTER_AXIS_SCROLL_VERTICAL);
-                            *scale -= scroll * opts.zoom_scale;
-                            if (*scale < MIN_SCALE) {
-                                *scale = MIN_SCALE;
-                            } else if (*scale > MAX_SCALE) {
-                                *scale = MAX_SCALE;
                             }
-                        }
-                        break;
-                    default:
-                }
-                libinput_event_destroy(li_ev);
+                            break;
+                    }
+                    break;
+                case RECORD_AXIS:
+                    if (input_grabbed) {
+                        has_zoom = true;
+                        double scroll = input.motion.dy;
+                        target_scale = clamp_scale(min_scale, target_scale - scroll * opts.zoom_scale);
+                    }
+                    break;
+                case RECORD_PINCH:
+                    // Only pinches which start while the modifiers are held
+                    // zoom. Many updates within a frame just move the target.
+                    if (input.flag == RECORD_PINCH_BEGIN) {
+                        pinching = input_grabbed;
+                        pinch_start_scale = target_scale;
+                    } else if (pinching) {
+                        has_zoom = true;
+                        target_scale = clamp_scale(min_scale, pinch_start_scale * input.motion.dx);
+                        if (input.flag == RECORD_PINCH_END) pinching = false;
+                    }
+                    break;
+                default:
             }
         }
 
+        trace_span("libinput dispatch", 0, span_start);
+
+        // Move the zoom towards its target
+        if (cursor_lens->scale != target_scale) {
+            has_zoom = true;
+            cursor_lens->scale += (target_scale - cursor_lens->scale) * ZOOM_SMOOTHING;
+            if (fabs(target_scale - cursor_lens->scale) < 0.001) cursor_lens->scale = target_scale;
+        }
+
+        if (opts.predict) {
+            predictor_predict(&predictor, cursor_x, cursor_y, &lens_x, &lens_y);
+        } else {
+            lens_x = cursor_x;
+            lens_y = cursor_y;
+        }
+        if (opts.fullscreen) {
+            // The bindings can't resize the full-screen lens
+            cursor_lens->width = root_attr.width;
+            cursor_lens->height = root_attr.height;
+            has_input |= lens_pan(cursor_lens, lens_x, lens_y, opts.edge_margin, root_attr.width, root_attr.height);
+        }
+
         // If there are new events from Xlib
-        int num_events = XQLength(d);
-        if (x_pollfd->revents & POLLIN && num_events > 0) {
-            //bool more = false;
-            //while (XPending(d) > 0) {
-            for (int i = 0; i < num_events; i++) {
-                XEvent x_ev;
-                XNextEvent(d, &x_ev);
-                XRRUpdateConfiguration(&x_ev);
-                if (x_ev.type == damage_notify_event) {
-                    has_damage = true;
-                    //more = ((XDamageNotifyEvent *) &x_ev)->more;
-                    //if (!more) break;
-                } else if (x_ev.type == screen_change_notify_event) {
-                    keep_looping = false;
+        span_start = trace_now();
+        bool should_raise = false;
+        while (XPending(d) > 0) {
+            XEvent x_ev;
+            XNextEvent(d, &x_ev);
+            XRRUpdateConfiguration(&x_ev);
+            if (x_ev.type == damage_notify_event) {
+                // Only damage to what the lenses show requires a redraw.
+                // Damage reported before a window stopped being tracked is
+                // relative to wherever it is now, not to the root.
+                XDamageNotifyEvent *damage_ev = (XDamageNotifyEvent *) &x_ev;
+                if (window_index_get(window_index, damage_ev->drawable) == NULL) continue;
+                struct rect area = {
+                    damage_ev->geometry.x + damage_ev->area.x,
+                    damage_ev->geometry.y + damage_ev->area.y,
+                    damage_ev->area.width, damage_ev->area.height
+                };
+                struct rect window_area = {
+                    damage_ev->area.x, damage_ev->area.y,
+                    damage_ev->area.width, damage_ev->area.height
+                };
+                record_event(recorder, window_record(RECORD_DAMAGE, damage_ev->drawable, window_area));
+                if (frozen) continue;
+                mipmap_damage(mipmap, area);
+                damage_bounds = rect_bounds(damage_bounds, area);
+                // The capture kept for zooming covers more than the lenses
+                if (rect_overlaps(area, zoom_capture)) zoom_capture_valid = false;
+                for (int i = 0; i < num_lenses && !has_damage; i++) {
+                    has_damage = rect_overlaps(
+                            area, lens_get_source(&lenses[i], lens_x, lens_y));
+                }
+            } else if (x_ev.type == cursor_notify_event) {
+                load_cursor_image(d, root, format_32, &cursor_image);
+                cursor_changed = true;
+            } else if (x_ev.type == screen_change_notify_event) {
+                keep_looping = false;
+            } else if (x_ev.type == CreateNotify) {
+                XCreateWindowEvent *create_ev = &x_ev.xcreatewindow;
+                if (create_ev->parent == root && create_ev->window != w) {
+                    track_window(d, window_index, recorder, query_window(c, create_ev->window));
+                }
+            } else if (x_ev.type == DestroyNotify) {
+                untrack_window(d, window_index, recorder, x_ev.xdestroywindow.window);
+            } else if (x_ev.type == ReparentNotify) {
+                XReparentEvent *reparent_ev = &x_ev.xreparent;
+                if (reparent_ev->parent != root) {
+                    untrack_window(d, window_index, recorder, reparent_ev->window);
+                } else if (reparent_ev->window != w) {
+                    track_window(d, window_index, recorder, query_window(c, reparent_ev->window));
+                }
+            } else if (x_ev.type == ConfigureNotify || x_ev.type == MapNotify
+                    || x_ev.type == UnmapNotify || x_ev.type == CirculateNotify) {
+                // Stacking and geometry changes of other windows may change
+                // what is under the lenses and may put a window above ours.
+                // Our own window being raised or reshaped changes neither.
+                Window changed_w = x_ev.type == ConfigureNotify ? x_ev.xconfigure.window
+                    : x_ev.type == MapNotify ? x_ev.xmap.window
+                    : x_ev.type == UnmapNotify ? x_ev.xunmap.window
+                    : x_ev.xcirculate.window;
+                struct indexed_window *window = window_index_get(window_index, changed_w);
+                if (window == NULL) continue;
+                struct rect old_rect = window->rect;
+                bool was_viewable = window->viewable;
+
+                if (x_ev.type == ConfigureNotify) {
+                    XConfigureEvent *configure_ev = &x_ev.xconfigure;
+                    struct rect rect = {
+                        configure_ev->x, configure_ev->y,
+                        configure_ev->width, configure_ev->height
+                    };
+                    if (rect.width != old_rect.width || rect.height != old_rect.height
+                            || configure_ev->border_width != window->border_width) {
+                        release_window_picture(d, window);
+                    }
+                    window->border_width = configure_ev->border_width;
+                    window_index_move(window_index, changed_w, rect);
+                    window_index_restack(window_index, changed_w, configure_ev->above);
+                    record_event(recorder, window_record(RECORD_CONFIGURE, changed_w, rect));
+                    record_event(recorder, (struct record) {
+                        .type = RECORD_RESTACK, .flag = RECORD_RESTACK_ABOVE,
+                        .window = changed_w, .above = configure_ev->above
+                    });
+                } else if (x_ev.type == MapNotify) {
+                    release_window_picture(d, window);
+                    window_index_set_viewable(window_index, changed_w, true);
+                    record_event(recorder, (struct record) { .type = RECORD_MAP, .window = changed_w });
+                } else if (x_ev.type == UnmapNotify) {
+                    release_window_picture(d, window);
+                    window_index_set_viewable(window_index, changed_w, false);
+                    record_event(recorder, (struct record) { .type = RECORD_UNMAP, .window = changed_w });
+                } else if (x_ev.xcirculate.place == PlaceOnTop) {
+                    window_index_raise(window_index, changed_w);
+                    record_event(recorder, (struct record) {
+                        .type = RECORD_RESTACK, .flag = RECORD_RESTACK_RAISE, .window = changed_w
+                    });
+                } else {
+                    window_index_lower(window_index, changed_w);
+                    record_event(recorder, (struct record) {
+                        .type = RECORD_RESTACK, .flag = RECORD_RESTACK_LOWER, .window = changed_w
+                    });
+                }
+
+                if (!frozen && (was_viewable || window->viewable)) {
+                    mipmap_damage(mipmap, old_rect);
+                    mipmap_damage(mipmap, window->rect);
+                    damage_bounds = rect_bounds(damage_bounds, rect_bounds(old_rect, window->rect));
+                    if (rect_overlaps(old_rect, zoom_capture) || rect_overlaps(window->rect, zoom_capture)) {
+                        zoom_capture_valid = false;
+                    }
+                    for (int i = 0; i < num_lenses && !has_damage; i++) {
+                        struct rect source = lens_get_source(&lenses[i], lens_x, lens_y);
+                        has_damage = rect_overlaps(old_rect, source)
+                            || rect_overlaps(window->rect, source);
+                    }
+                }
+                should_raise = true;
+            } else if (x_ev.type == PropertyNotify) {
+                if (x_ev.xproperty.atom == root_pixmap_atom) {
+                    root_background = get_root_background_pixmap(d, root, root_pixmap_atom);
+                    if (!frozen) {
+                        mipmap_damage_all(mipmap);
+                        has_damage = true;
+                    }
                 }
-                //printf("event: %i\n", x_ev.type);
             }
-            XDamageSubtract(d, damage, None, None);
         }
 
-        if (has_input || has_damage) {
+        trace_span("x events", 0, span_start);
+
+        // Outside full-screen mode the lens follows the cursor, so it has to
+        // be redrawn whenever the cursor moves
+        if (!opts.fullscreen) has_input |= cursor_changed;
+
+        if (has_input || has_damage || has_zoom || cursor_changed) {
             // Redraw the window contents
-            draw(
-                    *width, *height, *scale, cursor_x, cursor_y,
-                    dest_pixmap, final_pixmap,
-                    dest_pic, final_pic, root_attr, dest_attr, root, w, d, gc,
-                    format_32, format_24, format_1);
+            uint64_t draw_start = get_time_ns();
+            enum draw_result result;
+            if (!has_input && !has_damage && !has_zoom && !bypassed) {
+                // Only the cursor changed and the full-screen lens shows the
+                // same viewport as before, so the last capture and the rest
+                // of the last frame still stand
+                span_start = trace_now();
+                result = draw_cursor_only(
+                        cursor_lens, lens_x, lens_y, &cursor_image, &cursor_rect,
+                        dest_pic, mipmap, final_pixmap, final_pic, w, d, gc);
+                trace_span("draw", 0, span_start);
+            } else {
+                enum capture_mode capture_mode = CAPTURE_LENSES;
+                if (frozen) {
+                    capture_mode = capture_screen ? CAPTURE_SCREEN : CAPTURE_NONE;
+                } else if (has_zoom) {
+                    // Only the transform and scale composite need redoing
+                    // if nothing but the zoom changed and the capture at a
+                    // zoom of 1 covers the cursor lens's source. Below a zoom
+                    // of 1, the mipmap covers it.
+                    bool zoom_only = !has_input && !has_damage;
+                    struct rect source = lens_get_source(cursor_lens, lens_x, lens_y);
+                    bool covered = cursor_lens->scale < 1.0
+                        || (zoom_capture_valid && rect_contains(zoom_capture, source));
+                    capture_mode = zoom_only && covered ? CAPTURE_NONE : CAPTURE_ZOOM;
+                }
+                if (capture_mode == CAPTURE_ZOOM) {
+                    struct lens unzoomed = *cursor_lens;
+                    unzoomed.scale = 1.0;
+                    zoom_capture = lens_get_source(&unzoomed, lens_x, lens_y);
+                    zoom_capture_valid = true;
+                } else if (capture_mode != CAPTURE_NONE) {
+                    zoom_capture_valid = false;
+                }
+                capture_screen = false;
+                span_start = trace_now();
+                result = draw(
+                        lenses, num_lenses, lens_x, lens_y,
+                        dest_pixmap, final_pixmap,
+                        dest_pic, final_pic, root_attr, window_index, mipmap, opts.composite, capture_mode,
+                        root_background, root, w, d, gc, format_32, format_24, format_1,
+                        damage_bounds, must_finish ? NULL : li, opts.fullscreen ? &cursor_image : NULL, &bypassed);
+                trace_span("draw", 0, span_start);
+                // Nothing was captured for lenses drawn straight from a window
+                if (bypassed) zoom_capture_valid = false;
+                if (opts.fullscreen) {
+                    cursor_rect = get_cursor_rect(&cursor_image, cursor_lens, lens_x, lens_y);
+                }
+            }
             //XSync(d, false);
             //XFlush(d);
 
-            // Wait for completiona
-            XEvent x_ev;
-            wait_for_event(d, &x_ev, damage_notify_event);
-            wait_for_event(d, &x_ev, NoExpose);
-
-            // Sleep to prevent re-drawing faster than update rate
-            clock_gettime(CLOCK_MONOTONIC_RAW, &time);
-            const long one_second = 1000000000;
-            const long target_nsec = one_second / rate;
-            long delta_nsec =
-                (time.tv_sec - prev_time.tv_sec) * one_second
-                + (time.tv_nsec - prev_time.tv_nsec);
-            if (delta_nsec < target_nsec) {
-                struct timespec duration = {
-                    .tv_sec = 0,
-                    .tv_nsec = target_nsec - delta_nsec
-                };
-                struct timespec remaining = {
-                    .tv_nsec = 1
-                };
-                int success = -1;
-                while (success != 0) {
-                    success = nanosleep(&duration, &remaining);
-                    duration = remaining;
+            // A dropped frame is started again from the newest cursor
+            // position straight away, without waiting out the frame time
+            if (result == DRAW_ABORTED) {
+                restart_frame = true;
+            } else {
+                // Wait for completion
+                if (result == DRAW_PRESENTED) {
+                    span_start = trace_now();
+                    XEvent x_ev;
+                    wait_for_event(d, &x_ev, NoExpose);
+                    trace_span("wait for completion", 0, span_start);
+                }
+
+                uint64_t draw_end = get_time_ns();
+                if (replay != NULL) replay_frame_done(replay, draw_end - draw_start);
+                if (opts.predict) {
+                    predictor_frame_done(&predictor, draw_end - cursor_time);
+                    // Compare where the lens was drawn with where the cursor
+                    // actually is now that the frame is shown
+                    int actual_x;
+                    int actual_y;
+                    if (stats_enabled && get_cursor_position(d, root, &actual_x, &actual_y)) {
+                        stats_add(STAT_PREDICTION_ERROR, hypot(lens_x - actual_x, lens_y - actual_y));
+                        stats_add(STAT_UNPREDICTED_ERROR, hypot(cursor_x - actual_x, cursor_y - actual_y));
+                    }
+                }
+
+                if (export != NULL) {
+                    span_start = trace_now();
+                    publish_lenses(
+                            export, d, final_pixmap, lenses, num_lenses, lens_x, lens_y);
+                    trace_span("export", 0, span_start);
                 }
+
+                // Sleep to prevent re-drawing faster than update rate. Sleeping
+                // until an absolute deadline means neither an interrupted sleep
+                // nor the time spent setting it up adds to the frame time.
+                span_start = trace_now();
+                const long one_second = 1000000000;
+                struct timespec deadline = prev_time;
+                deadline.tv_nsec += one_second / rate;
+                if (deadline.tv_nsec >= one_second) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= one_second;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &time);
+                long remaining_nsec =
+                    (deadline.tv_sec - time.tv_sec) * one_second
+                    + (deadline.tv_nsec - time.tv_nsec);
+                if (remaining_nsec > 0) {
+                    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+                    clock_gettime(CLOCK_MONOTONIC, &time);
+                    long overshoot_nsec =
+                        (time.tv_sec - deadline.tv_sec) * one_second
+                        + (time.tv_nsec - deadline.tv_nsec);
+                    stats_add(STAT_SLEEP_OVERSHOOT, overshoot_nsec / 1e3);
+                }
+                trace_span("rate limit sleep", 0, span_start);
             }
         }
+        trace_end_frame(
+                (has_input || has_zoom || cursor_changed ? TRACE_CAUSE_INPUT : 0)
+                | (has_damage ? TRACE_CAUSE_DAMAGE : 0));
+
+        if (should_raise) XRaiseWindow(d, w);
+
+        stats_report_if_due();
 
-        //XSync(d, true);
-        XRaiseWindow(d, w);
+        if (replay != NULL && replay_finished(replay) && XPending(d) == 0) {
+            keep_looping = false;
+            should_exit = true;
+        }
     }
 
     // Clean up X objects
+    if (export != NULL) frame_export_destroy(export, d);
+    window_index_destroy(window_index);
+    mipmap_destroy(mipmap, d);
+    if (cursor_image.picture != None) XRenderFreePicture(d, cursor_image.picture);
+    if (opts.fullscreen) XFixesShowCursor(d, root);
+    if (redirected) XCompositeUnredirectSubwindows(d, root, CompositeRedirectAutomatic);
     XUngrabPointer(d, CurrentTime);
     XUngrabKeyboard(d, CurrentTime);
     /*
@@ -954,14 +2316,13 @@ static bool mgnfx(const char *display, const struct opts opts, int *width, int *
     XRenderFreePicture(d, dest_pic);
     XFreePixmap(d, final_pixmap);
     XRenderFreePicture(d, final_pic);
-    XDamageDestroy(d, damage);
     XDestroyWindow(d, w);
     */
     XCloseDisplay(d);
 
     // Clean up libinput
-    libinput_unref(li);
-    udev_unref(udev);
+    if (li != NULL) libinput_unref(li);
+    if (udev != NULL) udev_unref(udev);
 
     return should_exit;
 }
@@ -1024,14 +2385,32 @@ int main(int argc, char **argv) {
         exit_errno_if(close(pidfile), "Closing pidfile failed");
     }
 
+    if (opts.trace_path != NULL) trace_init(opts.trace_path);
+    if (opts.stats_interval > 0.0) stats_init(opts.stats_interval);
+    if (opts.rt_policy != -1) realtime_set_scheduling(opts.rt_policy, opts.rt_priority);
+    if (opts.min_timer_slack) realtime_set_timer_slack();
+    struct recorder *recorder = NULL;
+    struct replay *replay = opts.replay_path != NULL ? replay_open(opts.replay_path) : NULL;
+
     // Main loop
-    int width = opts.width;
-    int height = opts.height;
-    double scale = opts.zoom;
+    struct lens lenses[MAX_LENSES];
+    lenses[0] = (struct lens) {
+        .width = opts.width,
+        .height = opts.height,
+        .scale = opts.zoom
+    };
+    for (unsigned int i = 0; i < opts.num_docked_lenses; i++) {
+        lenses[i + 1] = opts.docked_lenses[i];
+    }
+    int num_lenses = opts.num_docked_lenses + 1;
     bool should_exit = false;
     while (!should_exit) {
-        should_exit = mgnfx(display, opts, &width, &height, &scale, opts.rate);
+        should_exit = mgnfx(display, opts, lenses, num_lenses, opts.rate, &recorder, replay);
     }
+    trace_write();
+    stats_report();
+    if (recorder != NULL) recorder_destroy(recorder);
+    if (replay != NULL) replay_close(replay);
 
     // Remove pidfile, if it was created
     if (xdg_runtime_dir != -1) {
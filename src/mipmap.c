@@ -0,0 +1,191 @@
+#include "mipmap.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MIPMAP_TILE_SIZE
+#define MIPMAP_TILE_SIZE 256
+#endif
+
+#define MIPMAP_MAX_LEVELS 16
+
+struct mipmap {
+    int width;
+    int height;
+    int num_levels;
+    // Level 0 is the capture, which the mipmap doesn't own
+    Pixmap pixmaps[MIPMAP_MAX_LEVELS];
+    Picture pictures[MIPMAP_MAX_LEVELS];
+
+    int cols;
+    int rows;
+    bool *dirty;
+};
+
+static void set_scale(Display *d, Picture picture, double scale) {
+    XFixed scale_f = XDoubleToFixed(scale);
+    XFixed one_f = XDoubleToFixed(1.0);
+    XFixed zero_f = XDoubleToFixed(0.0);
+    XTransform transform = {{
+        {scale_f, zero_f, zero_f},
+        {zero_f, scale_f, zero_f},
+        {zero_f, zero_f, one_f}
+    }};
+    XRenderSetPictureTransform(d, picture, &transform);
+}
+
+struct mipmap *mipmap_create(
+        Display *d, Window root, Picture capture_pic, int width, int height, int depth,
+        XRenderPictFormat *format, double min_scale)
+{
+    struct mipmap *m = calloc(1, sizeof(*m));
+    exit_error_if(m == NULL, "Allocating mipmap failed");
+    m->width = width;
+    m->height = height;
+    m->cols = (width + MIPMAP_TILE_SIZE - 1) / MIPMAP_TILE_SIZE;
+    m->rows = (height + MIPMAP_TILE_SIZE - 1) / MIPMAP_TILE_SIZE;
+    m->dirty = malloc(m->cols * m->rows * sizeof(bool));
+    exit_error_if(m->dirty == NULL, "Allocating mipmap failed");
+    mipmap_damage_all(m);
+
+    m->num_levels = 1;
+    m->pictures[0] = capture_pic;
+    while (m->num_levels < MIPMAP_MAX_LEVELS
+            && 1.0 / (1 << m->num_levels) >= min_scale
+            && (width >> m->num_levels) > 0 && (height >> m->num_levels) > 0)
+    {
+        int level = m->num_levels;
+        int level_width = (width + (1 << level) - 1) >> level;
+        int level_height = (height + (1 << level) - 1) >> level;
+        m->pixmaps[level] = XCreatePixmap(d, root, level_width, level_height, depth);
+        m->pictures[level] = XRenderCreatePicture(d, m->pixmaps[level], format, 0, NULL);
+        exit_error_if(m->pictures[level] == None, "Creating mipmap XRender picture failed");
+        // Levels are only ever read scaled, so always filter them
+        XRenderSetPictureFilter(d, m->pictures[level], FilterBilinear, NULL, 0);
+        m->num_levels++;
+    }
+    return m;
+}
+
+void mipmap_destroy(struct mipmap *m, Display *d) {
+    for (int level = 1; level < m->num_levels; level++) {
+        XRenderFreePicture(d, m->pictures[level]);
+        XFreePixmap(d, m->pixmaps[level]);
+    }
+    free(m->dirty);
+    free(m);
+}
+
+// Get the range of tiles overlapping `area`, returning false if there are none
+static bool get_tiles(
+        const struct mipmap *m, struct rect area,
+        int *col_start, int *row_start, int *col_end, int *row_end)
+{
+    struct rect screen_rect = { 0, 0, m->width, m->height };
+    if (!rect_intersect(area, screen_rect, &area)) return false;
+    *col_start = area.x / MIPMAP_TILE_SIZE;
+    *row_start = area.y / MIPMAP_TILE_SIZE;
+    *col_end = (area.x + area.width + MIPMAP_TILE_SIZE - 1) / MIPMAP_TILE_SIZE;
+    *row_end = (area.y + area.height + MIPMAP_TILE_SIZE - 1) / MIPMAP_TILE_SIZE;
+    return true;
+}
+
+void mipmap_damage(struct mipmap *m, struct rect area) {
+    int col_start, row_start, col_end, row_end;
+    if (!get_tiles(m, area, &col_start, &row_start, &col_end, &row_end)) return;
+    for (int row = row_start; row < row_end; row++) {
+        memset(&m->dirty[row * m->cols + col_start], true, col_end - col_start);
+    }
+}
+
+void mipmap_damage_all(struct mipmap *m) {
+    memset(m->dirty, true, m->cols * m->rows * sizeof(bool));
+}
+
+int mipmap_get_dirty(struct mipmap *m, struct rect area, struct rect *runs, int max_runs) {
+    int col_start, row_start, col_end, row_end;
+    if (!get_tiles(m, area, &col_start, &row_start, &col_end, &row_end)) return 0;
+
+    struct rect screen_rect = { 0, 0, m->width, m->height };
+    int num_runs = 0;
+    for (int row = row_start; row < row_end; row++) {
+        // One run from the first to the last dirty tile of the row
+        int first = -1;
+        int last = -1;
+        for (int col = col_start; col < col_end; col++) {
+            if (!m->dirty[row * m->cols + col]) continue;
+            if (first == -1) first = col;
+            last = col;
+        }
+        if (first == -1) continue;
+
+        struct rect run = {
+            first * MIPMAP_TILE_SIZE, row * MIPMAP_TILE_SIZE,
+            (last - first + 1) * MIPMAP_TILE_SIZE, MIPMAP_TILE_SIZE
+        };
+        rect_intersect(run, screen_rect, &run);
+        // Merge runs into the last one once there's no room for more
+        if (num_runs == max_runs) {
+            runs[num_runs - 1] = rect_bounds(runs[num_runs - 1], run);
+        } else {
+            runs[num_runs++] = run;
+        }
+    }
+    return num_runs;
+}
+
+void mipmap_update(struct mipmap *m, Display *d, const struct rect *areas, int num_areas) {
+    // Sampling halfway between four pixels with a bilinear filter averages
+    // them, so each level is a box filtered copy of the level below
+    for (int level = 1; level < m->num_levels; level++) {
+        Picture src = m->pictures[level - 1];
+        set_scale(d, src, 2.0);
+        if (level == 1) XRenderSetPictureFilter(d, src, FilterBilinear, NULL, 0);
+
+        int level_width = (m->width + (1 << level) - 1) >> level;
+        int level_height = (m->height + (1 << level) - 1) >> level;
+        for (int i = 0; i < num_areas; i++) {
+            int x = areas[i].x >> level;
+            int y = areas[i].y >> level;
+            int right = (areas[i].x + areas[i].width + (1 << level) - 1) >> level;
+            int bottom = (areas[i].y + areas[i].height + (1 << level) - 1) >> level;
+            if (right > level_width) right = level_width;
+            if (bottom > level_height) bottom = level_height;
+            if (right <= x || bottom <= y) continue;
+            XRenderComposite(
+                    d, PictOpSrc, src, None, m->pictures[level],
+                    x, y, 0, 0, x, y, right - x, bottom - y);
+        }
+    }
+    // The capture is also read unfiltered by magnifying lenses
+    if (m->num_levels > 1) XRenderSetPictureFilter(d, m->pictures[0], FilterNearest, NULL, 0);
+
+    // Only tiles entirely within an area are up to date now
+    for (int i = 0; i < num_areas; i++) {
+        struct rect area = areas[i];
+        int col_start = (area.x + MIPMAP_TILE_SIZE - 1) / MIPMAP_TILE_SIZE;
+        int row_start = (area.y + MIPMAP_TILE_SIZE - 1) / MIPMAP_TILE_SIZE;
+        int col_end = area.x + area.width >= m->width
+            ? m->cols : (area.x + area.width) / MIPMAP_TILE_SIZE;
+        int row_end = area.y + area.height >= m->height
+            ? m->rows : (area.y + area.height) / MIPMAP_TILE_SIZE;
+        if (col_start < 0) col_start = 0;
+        if (row_start < 0) row_start = 0;
+        for (int row = row_start; row < row_end; row++) {
+            for (int col = col_start; col < col_end; col++) {
+                m->dirty[row * m->cols + col] = false;
+            }
+        }
+    }
+}
+
+int mipmap_get_level(const struct mipmap *m, double scale) {
+    int level = scale < 1.0 ? (int) floor(log2(1.0 / scale)) : 0;
+    return level < m->num_levels ? level : m->num_levels - 1;
+}
+
+Picture mipmap_get_picture(const struct mipmap *m, int level) {
+    return m->pictures[level];
+}
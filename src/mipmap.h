@@ -0,0 +1,41 @@
+#pragma once
+
+#include "rect.h"
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrender.h>
+
+#include <stdbool.h>
+
+// A pyramid of successively halved copies of the screen capture, for drawing
+// lenses which shrink the screen. Level 0 is the capture itself and level k
+// is 2^k times smaller. The capture is split into tiles which are marked dirty
+// by damage; only dirty tiles need to be captured again and have the levels
+// above them rebuilt.
+struct mipmap;
+
+// `capture_pic` is level 0, covering `width` by `height`. Enough levels are
+// created to draw zooms down to `min_scale` from a level at most 2 times
+// larger. Every tile starts out dirty.
+struct mipmap *mipmap_create(
+        Display *d, Window root, Picture capture_pic, int width, int height, int depth,
+        XRenderPictFormat *format, double min_scale);
+void mipmap_destroy(struct mipmap *m, Display *d);
+
+// Mark the tiles overlapping `area` as dirty
+void mipmap_damage(struct mipmap *m, struct rect area);
+void mipmap_damage_all(struct mipmap *m);
+
+// Get the dirty tiles overlapping `area` as at most `max_runs` rectangles,
+// usually one per row of tiles. The caller should capture them and then pass
+// them to `mipmap_update()`. Returns the number of rectangles.
+int mipmap_get_dirty(struct mipmap *m, struct rect area, struct rect *runs, int max_runs);
+
+// Rebuild every level above level 0 within `areas`, which have just been
+// captured, and mark the tiles they cover as clean
+void mipmap_update(struct mipmap *m, Display *d, const struct rect *areas, int num_areas);
+
+// Get the smallest level which is at least as large as the screen shown at
+// `scale`
+int mipmap_get_level(const struct mipmap *m, double scale);
+Picture mipmap_get_picture(const struct mipmap *m, int level);
@@ -0,0 +1,59 @@
+#include "predict.h"
+#include "util.h"
+
+#include <math.h>
+
+// Weight of each new frame latency in the smoothed lead time
+#define LEAD_SMOOTHING 0.1
+
+void predictor_init(struct predictor *p) {
+    *p = (struct predictor) { 0 };
+}
+
+static double smoothing_factor(double dt, double cutoff) {
+    double tau = 1.0 / (2.0 * M_PI * cutoff);
+    return 1.0 / (1.0 + tau / dt);
+}
+
+void predictor_motion(struct predictor *p, uint32_t time_us, double dx, double dy) {
+    uint64_t received_ns = get_time_ns();
+    // Unsigned subtraction handles the timestamp wrapping
+    uint32_t dt_us = time_us - p->last_time_us;
+    bool was_idle = received_ns - p->last_received_ns > PREDICT_IDLE_MS * 1000000ull;
+
+    if (!p->moving || was_idle || dt_us == 0 || dt_us > PREDICT_IDLE_MS * 1000u) {
+        // There's no interval to measure the velocity over yet
+        p->vx = 0.0;
+        p->vy = 0.0;
+        p->moving = true;
+    } else {
+        double dt = dt_us / 1e6;
+        double speed = hypot(p->vx, p->vy);
+        double alpha = smoothing_factor(dt, PREDICT_MIN_CUTOFF + PREDICT_BETA * speed);
+        p->vx += alpha * (dx / dt - p->vx);
+        p->vy += alpha * (dy / dt - p->vy);
+    }
+    p->last_time_us = time_us;
+    p->last_received_ns = received_ns;
+}
+
+void predictor_predict(
+        const struct predictor *p, int x, int y, int *predicted_x, int *predicted_y)
+{
+    *predicted_x = x;
+    *predicted_y = y;
+    if (!p->moving || get_time_ns() - p->last_received_ns > PREDICT_IDLE_MS * 1000000ull) return;
+
+    double lead = fmin(p->lead_us, PREDICT_MAX_LEAD_MS * 1000.0) / 1e6;
+    *predicted_x = lround(x + p->vx * lead);
+    *predicted_y = lround(y + p->vy * lead);
+}
+
+void predictor_frame_done(struct predictor *p, uint64_t latency_ns) {
+    double latency_us = latency_ns / 1e3;
+    if (p->lead_us == 0.0) {
+        p->lead_us = latency_us;
+    } else {
+        p->lead_us += LEAD_SMOOTHING * (latency_us - p->lead_us);
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Extrapolates the cursor to the time a frame is expected to be presented,
+// from the timestamped pointer motion reported by libinput. The velocity is
+// smoothed with a one-euro filter, whose cutoff frequency rises with speed so
+// that slow movement is steady and fast movement isn't lagged.
+
+#ifndef PREDICT_MIN_CUTOFF
+// Cutoff frequency of the velocity filter at rest (Hz)
+#define PREDICT_MIN_CUTOFF 5.0
+#endif
+
+#ifndef PREDICT_BETA
+// Increase in cutoff frequency per pixel per second of speed
+#define PREDICT_BETA 0.01
+#endif
+
+#ifndef PREDICT_IDLE_MS
+// The cursor is assumed to have stopped when there has been no motion for
+// this long
+#define PREDICT_IDLE_MS 40
+#endif
+
+#ifndef PREDICT_MAX_LEAD_MS
+// Never extrapolate further ahead than this
+#define PREDICT_MAX_LEAD_MS 50
+#endif
+
+struct predictor {
+    bool moving;
+    // libinput time of the last motion event (microseconds, wrapping)
+    uint32_t last_time_us;
+    // When the last motion event was received (CLOCK_MONOTONIC nanoseconds)
+    uint64_t last_received_ns;
+    // Filtered velocity (pixels per second)
+    double vx;
+    double vy;
+    // Smoothed time from sampling the cursor until the frame is presented
+    // (microseconds)
+    double lead_us;
+};
+
+void predictor_init(struct predictor *p);
+
+// Add a motion event which moved the pointer by `dx`, `dy` at `time_us`
+void predictor_motion(struct predictor *p, uint32_t time_us, double dx, double dy);
+
+// Predict where the cursor, sampled at (`x`, `y`) just now, will be when the
+// frame being drawn is presented
+void predictor_predict(
+        const struct predictor *p, int x, int y, int *predicted_x, int *predicted_y);
+
+// Report how long it took from sampling the cursor until a frame completed
+void predictor_frame_done(struct predictor *p, uint64_t latency_ns);
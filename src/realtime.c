@@ -0,0 +1,34 @@
+#define _GNU_SOURCE
+
+#include "realtime.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+
+void realtime_set_scheduling(int policy, int priority) {
+    struct sched_param param = { .sched_priority = priority };
+    if (sched_setscheduler(0, policy, &param) == 0) return;
+    fprintf(stderr, "Setting real-time scheduling failed: %s. Trying nice instead.\n", strerror(errno));
+
+    if (setpriority(PRIO_PROCESS, 0, FALLBACK_NICE) != 0) {
+        fprintf(stderr, "Setting niceness failed: %s.\n", strerror(errno));
+    }
+}
+
+void realtime_lock_memory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "Locking memory failed: %s.\n", strerror(errno));
+    }
+}
+
+void realtime_set_timer_slack(void) {
+    // 0 would reset the slack to the default, so 1 ns is the minimum
+    if (prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0) != 0) {
+        fprintf(stderr, "Setting timer slack failed: %s.\n", strerror(errno));
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// Options for keeping the render loop responsive on a loaded system
+
+#ifndef DEFAULT_RT_PRIORITY
+#define DEFAULT_RT_PRIORITY 10
+#endif
+
+#ifndef FALLBACK_NICE
+// Niceness to use when a real-time policy isn't allowed
+#define FALLBACK_NICE -10
+#endif
+
+// Use the real-time scheduling `policy` (SCHED_FIFO or SCHED_RR) at
+// `priority`. If that isn't allowed, lower the niceness instead, and if that
+// isn't allowed either, print a warning and carry on.
+void realtime_set_scheduling(int policy, int priority);
+
+// Lock all current and future memory, so the render loop never waits on a
+// page fault. Prints a warning if that isn't allowed.
+void realtime_lock_memory(void);
+
+// Have timers wake the process as close to their expiry as possible
+void realtime_set_timer_slack(void);
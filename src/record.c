@@ -0,0 +1,325 @@
+#include "record.h"
+#include "util.h"
+
+#include <X11/Xutil.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RECORD_MAGIC "MGRC"
+#define RECORD_VERSION 2
+
+
+struct recorder {
+    FILE *file;
+    bool started;
+    uint64_t start_ns;
+};
+
+struct recorder *recorder_create(const char *path, int root_width, int root_height) {
+    struct recorder *r = calloc(1, sizeof(*r));
+    exit_error_if(r == NULL, "Allocating recorder failed");
+    r->file = fopen(path, "wb");
+    if (r->file == NULL) exit_errno("Opening recording failed");
+    // Buffer generously so that recording rarely has to write to disk
+    setvbuf(r->file, NULL, _IOFBF, 1 << 20);
+
+    struct record_header header = {
+        .magic = RECORD_MAGIC,
+        .version = RECORD_VERSION,
+        .root_width = root_width,
+        .root_height = root_height
+    };
+    exit_error_if(fwrite(&header, sizeof(header), 1, r->file) != 1, "Writing recording failed");
+    return r;
+}
+
+void recorder_start(struct recorder *r) {
+    if (r->started) return;
+    r->started = true;
+    r->start_ns = get_time_ns();
+}
+
+void recorder_write(struct recorder *r, struct record record) {
+    record.time_us = r->started ? (get_time_ns() - r->start_ns) / 1000 : 0;
+    exit_error_if(fwrite(&record, sizeof(record), 1, r->file) != 1, "Writing recording failed");
+}
+
+void recorder_destroy(struct recorder *r) {
+    if (fclose(r->file) != 0) exit_errno("Writing recording failed");
+    free(r);
+}
+
+
+struct replica {
+    uint32_t recorded;
+    Window window;
+    // For drawing into the window, which must have the window's depth
+    GC gc;
+};
+
+struct replay {
+    struct record *records;
+    size_t num_records;
+    size_t next;
+
+    // Input records which are due but haven't been taken yet
+    struct record *pending;
+    size_t pending_start;
+    size_t pending_end;
+    size_t pending_cap;
+
+    // Windows created to stand in for the recorded windows
+    struct replica *replicas;
+    size_t num_replicas;
+    size_t replicas_cap;
+
+    Display *d;
+    Window root;
+    GC gc;
+    unsigned long colour;
+    // Colormaps and GCs for replicas of windows whose depth isn't the
+    // root's, by depth, or None and NULL
+    Colormap colormaps[33];
+    GC gcs[33];
+    uint32_t root_width;
+    uint32_t root_height;
+    uint64_t start_ns;
+
+    uint64_t *frame_times;
+    size_t num_frames;
+    size_t frames_cap;
+};
+
+struct replay *replay_open(const char *path) {
+    struct replay *r = calloc(1, sizeof(*r));
+    exit_error_if(r == NULL, "Allocating replay failed");
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) exit_errno("Opening recording failed");
+    struct record_header header;
+    bool is_recording = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic)) == 0
+        && header.version == RECORD_VERSION;
+    exit_error_if(!is_recording, "Not a mgnfx recording, or an incompatible version");
+    r->root_width = header.root_width;
+    r->root_height = header.root_height;
+
+    size_t cap = 0;
+    while (true) {
+        reserve(&r->records, &cap, r->num_records + 1024, sizeof(struct record));
+        size_t num_read = fread(&r->records[r->num_records], sizeof(struct record), 1024, file);
+        r->num_records += num_read;
+        if (num_read < 1024) break;
+    }
+    if (ferror(file)) exit_errno("Reading recording failed");
+    fclose(file);
+    return r;
+}
+
+static struct replica *find_replica(struct replay *r, uint32_t recorded) {
+    for (size_t i = 0; i < r->num_replicas; i++) {
+        if (r->replicas[i].recorded == recorded) return &r->replicas[i];
+    }
+    return NULL;
+}
+
+static void apply_record(struct replay *r, const struct record *record) {
+    Display *d = r->d;
+    Window root = r->root;
+    struct replica *replica = find_replica(r, record->window);
+    Window window = replica != NULL ? replica->window : None;
+    int width = record->rect.width > 0 ? record->rect.width : 1;
+    int height = record->rect.height > 0 ? record->rect.height : 1;
+
+    switch (record->type) {
+        case RECORD_KEY:
+        case RECORD_BUTTON:
+        case RECORD_AXIS:
+        case RECORD_MOTION:
+        case RECORD_PINCH:
+            reserve(&r->pending, &r->pending_cap, r->pending_end + 1, sizeof(struct record));
+            r->pending[r->pending_end++] = *record;
+            break;
+        case RECORD_CURSOR:
+            XWarpPointer(d, None, root, 0, 0, 0, 0, record->rect.x, record->rect.y);
+            break;
+        case RECORD_DAMAGE:
+            // Draw something different each time, so the damage is real
+            if (window == None) break;
+            XSetForeground(d, replica->gc, r->colour++);
+            XFillRectangle(d, window, replica->gc, record->rect.x, record->rect.y, width, height);
+            break;
+        case RECORD_CREATE:
+            // Windows are recorded again whenever the display is reopened
+            if (window != None) break;
+            XSetWindowAttributes attr = {
+                .override_redirect = true,
+                .background_pixel = record->window * 2654435761u
+            };
+            unsigned long attr_mask = CWOverrideRedirect | CWBackPixel;
+            // Windows are captured differently depending on their depth, so
+            // replicas have the recorded depth where the server has a visual
+            // for it. Other depths than the root's need their own colormap.
+            int depth = CopyFromParent;
+            Visual *visual = CopyFromParent;
+            GC gc = r->gc;
+            int screen = DefaultScreen(d);
+            XVisualInfo visual_info;
+            if (record->code != DefaultDepth(d, screen) && record->code <= 32
+                    && XMatchVisualInfo(d, screen, record->code, TrueColor, &visual_info)) {
+                depth = record->code;
+                visual = visual_info.visual;
+                if (r->colormaps[depth] == None) {
+                    r->colormaps[depth] = XCreateColormap(d, root, visual, AllocNone);
+                }
+                attr.colormap = r->colormaps[depth];
+                attr.border_pixel = 0;
+                attr_mask |= CWColormap | CWBorderPixel;
+            }
+            window = XCreateWindow(
+                    d, root, record->rect.x, record->rect.y, width, height, 0,
+                    depth, InputOutput, visual, attr_mask, &attr);
+            if (depth != CopyFromParent) {
+                if (r->gcs[depth] == NULL) r->gcs[depth] = XCreateGC(d, window, 0, NULL);
+                gc = r->gcs[depth];
+            }
+            reserve(&r->replicas, &r->replicas_cap, r->num_replicas + 1, sizeof(struct replica));
+            r->replicas[r->num_replicas++] = (struct replica) { record->window, window, gc };
+            if (record->flag) XMapWindow(d, window);
+            break;
+        case RECORD_DESTROY:
+            if (window == None) break;
+            XDestroyWindow(d, window);
+            for (size_t i = 0; i < r->num_replicas; i++) {
+                if (r->replicas[i].window == window) {
+                    r->replicas[i] = r->replicas[--r->num_replicas];
+                    break;
+                }
+            }
+            break;
+        case RECORD_CONFIGURE:
+            if (window == None) break;
+            XMoveResizeWindow(d, window, record->rect.x, record->rect.y, width, height);
+            break;
+        case RECORD_RESTACK:
+            if (window == None) break;
+            if (record->flag == RECORD_RESTACK_RAISE) {
+                XRaiseWindow(d, window);
+            } else if (record->flag == RECORD_RESTACK_LOWER || record->above == None) {
+                XLowerWindow(d, window);
+            } else {
+                struct replica *sibling = find_replica(r, record->above);
+                if (sibling == NULL) {
+                    XRaiseWindow(d, window);
+                } else {
+                    XWindowChanges changes = { .sibling = sibling->window, .stack_mode = Above };
+                    XConfigureWindow(d, window, CWSibling | CWStackMode, &changes);
+                }
+            }
+            break;
+        case RECORD_MAP:
+            if (window != None) XMapWindow(d, window);
+            break;
+        case RECORD_UNMAP:
+            if (window != None) XUnmapWindow(d, window);
+            break;
+    }
+}
+
+void replay_start(struct replay *r, const char *display) {
+    if (r->d != NULL) return;
+    r->d = XOpenDisplay(display);
+    exit_error_if(r->d == NULL, "Failed to open X display for replay");
+    r->root = DefaultRootWindow(r->d);
+    r->gc = XCreateGC(r->d, r->root, 0, NULL);
+
+    XWindowAttributes root_attr;
+    XGetWindowAttributes(r->d, r->root, &root_attr);
+    if ((uint32_t) root_attr.width != r->root_width || (uint32_t) root_attr.height != r->root_height) {
+        fprintf(stderr,
+                "Warning: recorded on a %ux%u screen, replaying on %dx%d\n",
+                r->root_width, r->root_height, root_attr.width, root_attr.height);
+    }
+
+    while (r->next < r->num_records && r->records[r->next].time_us == 0) {
+        apply_record(r, &r->records[r->next]);
+        r->next++;
+    }
+    XSync(r->d, false);
+    r->start_ns = get_time_ns();
+}
+
+void replay_apply(struct replay *r) {
+    uint64_t now_us = (get_time_ns() - r->start_ns) / 1000;
+    while (r->next < r->num_records && r->records[r->next].time_us <= now_us) {
+        apply_record(r, &r->records[r->next]);
+        r->next++;
+    }
+    XFlush(r->d);
+}
+
+bool replay_next_input(struct replay *r, struct record *record) {
+    if (r->pending_start == r->pending_end) {
+        r->pending_start = 0;
+        r->pending_end = 0;
+        return false;
+    }
+    *record = r->pending[r->pending_start++];
+    return true;
+}
+
+int replay_timeout(struct replay *r) {
+    if (r->next >= r->num_records) return -1;
+    uint64_t now_us = (get_time_ns() - r->start_ns) / 1000;
+    uint64_t due_us = r->records[r->next].time_us;
+    return due_us <= now_us ? 0 : (due_us - now_us + 999) / 1000;
+}
+
+bool replay_finished(struct replay *r) {
+    return r->next >= r->num_records && r->pending_start == r->pending_end;
+}
+
+void replay_frame_done(struct replay *r, uint64_t nsec) {
+    reserve(&r->frame_times, &r->frames_cap, r->num_frames + 1, sizeof(uint64_t));
+    r->frame_times[r->num_frames++] = nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t u1 = *(const uint64_t *) a;
+    uint64_t u2 = *(const uint64_t *) b;
+    return (u1 > u2) - (u1 < u2);
+}
+
+void replay_close(struct replay *r) {
+    if (r->num_frames > 0) {
+        qsort(r->frame_times, r->num_frames, sizeof(uint64_t), compare_u64);
+        uint64_t total = 0;
+        for (size_t i = 0; i < r->num_frames; i++) total += r->frame_times[i];
+        size_t last = r->num_frames - 1;
+        fprintf(stderr,
+                "Replayed %zu frames (ms): mean %.3f, median %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+                r->num_frames,
+                total / 1e6 / r->num_frames,
+                r->frame_times[last / 2] / 1e6,
+                r->frame_times[last * 90 / 100] / 1e6,
+                r->frame_times[last * 99 / 100] / 1e6,
+                r->frame_times[last] / 1e6);
+    } else {
+        fputs("Replayed 0 frames\n", stderr);
+    }
+
+    if (r->d != NULL) {
+        XFreeGC(r->d, r->gc);
+        for (int depth = 0; depth <= 32; depth++) {
+            if (r->gcs[depth] != NULL) XFreeGC(r->d, r->gcs[depth]);
+        }
+        XCloseDisplay(r->d);
+    }
+    free(r->records);
+    free(r->pending);
+    free(r->replicas);
+    free(r->frame_times);
+    free(r);
+}
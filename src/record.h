@@ -0,0 +1,115 @@
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Recording and replaying of the input, cursor, damage and window events seen
+// by the render loop, for reproducing stutter and benchmarking builds against
+// each other on identical workloads.
+//
+// A recording is a `struct record_header` followed by fixed size records.
+// Records made before `recorder_start()` (the window layout at startup) have
+// a time of 0. Replaying rebuilds the window layout on the current display
+// (meant to be a fresh Xvfb) and then plays the remaining records back at
+// their original times.
+
+enum record_type {
+    // Input events, in place of libinput events
+    RECORD_KEY,
+    RECORD_BUTTON,
+    RECORD_AXIS,
+    RECORD_MOTION,
+
+    RECORD_CURSOR,
+    RECORD_DAMAGE,
+
+    // Top-level window events
+    RECORD_CREATE,
+    RECORD_DESTROY,
+    RECORD_CONFIGURE,
+    RECORD_RESTACK,
+    RECORD_MAP,
+    RECORD_UNMAP,
+
+    // Touchpad pinch gesture, an input event
+    RECORD_PINCH,
+};
+
+// `flag` values of RECORD_RESTACK
+#define RECORD_RESTACK_ABOVE 0
+#define RECORD_RESTACK_RAISE 1
+#define RECORD_RESTACK_LOWER 2
+
+// `flag` values of RECORD_PINCH
+#define RECORD_PINCH_BEGIN 0
+#define RECORD_PINCH_UPDATE 1
+#define RECORD_PINCH_END 2
+
+struct record {
+    // Microseconds since the recording started. Live motion events carry
+    // their libinput time here instead, so that either can be used to
+    // measure the time between motion events.
+    uint64_t time_us;
+    uint8_t type;
+    // Key or button state, viewability of created windows, restack mode
+    uint8_t flag;
+    // Key or button code, depth of created windows
+    uint16_t code;
+    uint32_t window;
+    union {
+        // Window geometry, damage area (relative to the window) or cursor
+        // position
+        struct {
+            int16_t x;
+            int16_t y;
+            uint16_t width;
+            uint16_t height;
+        } rect;
+        // Pointer motion, scroll amount (`dy`) or pinch scale since the
+        // gesture began (`dx`)
+        struct {
+            float dx;
+            float dy;
+        } motion;
+        // Sibling which a window was restacked above
+        uint32_t above;
+    };
+};
+
+_Static_assert(sizeof(struct record) == 24, "records should stay compact");
+
+struct record_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t root_width;
+    uint32_t root_height;
+};
+
+struct recorder;
+
+struct recorder *recorder_create(const char *path, int root_width, int root_height);
+// Start the clock for the time of subsequent records
+void recorder_start(struct recorder *r);
+void recorder_write(struct recorder *r, struct record record);
+void recorder_destroy(struct recorder *r);
+
+struct replay;
+
+struct replay *replay_open(const char *path);
+// Connect to `display`, create the windows recorded at startup and start
+// playing back. The replay uses its own connection so that it acts like any
+// other client; calling this again after it has started does nothing.
+void replay_start(struct replay *r, const char *display);
+// Apply the window, cursor and damage records which are due and queue the
+// due input records for `replay_next_input()`
+void replay_apply(struct replay *r);
+bool replay_next_input(struct replay *r, struct record *record);
+// Milliseconds until the next record is due, or -1 if there are none left
+int replay_timeout(struct replay *r);
+bool replay_finished(struct replay *r);
+// Report how long a frame took from the start of drawing until completion
+void replay_frame_done(struct replay *r, uint64_t nsec);
+// Print a summary of the frame times and free the replay
+void replay_close(struct replay *r);
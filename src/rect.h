@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+
+struct rect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Store the overlap of `a` and `b` in `out` and return whether it is non-empty
+static inline bool rect_intersect(struct rect a, struct rect b, struct rect *out) {
+    int left = a.x > b.x ? a.x : b.x;
+    int top = a.y > b.y ? a.y : b.y;
+    int right = a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width;
+    int bottom = a.y + a.height < b.y + b.height ? a.y + a.height : b.y + b.height;
+    *out = (struct rect) { left, top, right - left, bottom - top };
+    return out->width > 0 && out->height > 0;
+}
+
+static inline bool rect_overlaps(struct rect a, struct rect b) {
+    struct rect dummy_rect;
+    return rect_intersect(a, b, &dummy_rect);
+}
+
+static inline bool rect_contains(struct rect outer, struct rect inner) {
+    return inner.x >= outer.x && inner.y >= outer.y
+        && inner.x + inner.width <= outer.x + outer.width
+        && inner.y + inner.height <= outer.y + outer.height;
+}
+
+// Smallest rectangle containing both `a` and `b`. Empty rectangles are ignored.
+static inline struct rect rect_bounds(struct rect a, struct rect b) {
+    if (a.width <= 0 || a.height <= 0) return b;
+    if (b.width <= 0 || b.height <= 0) return a;
+    int left = a.x < b.x ? a.x : b.x;
+    int top = a.y < b.y ? a.y : b.y;
+    int right = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int bottom = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    return (struct rect) { left, top, right - left, bottom - top };
+}
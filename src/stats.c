@@ -0,0 +1,63 @@
+#include "stats.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct series {
+    const char *name;
+    const char *unit;
+    uint64_t count;
+    double sum;
+    double sum_squares;
+    double max;
+};
+
+bool stats_enabled = false;
+
+static struct series series[NUM_STATS] = {
+    [STAT_PREDICTION_ERROR] = { "prediction error", "px" },
+    [STAT_UNPREDICTED_ERROR] = { "unpredicted error", "px" },
+    [STAT_SLEEP_OVERSHOOT] = { "sleep overshoot", "us" },
+};
+static double interval_ns;
+static uint64_t last_report;
+
+void stats_init(double interval) {
+    interval_ns = interval * 1e9;
+    last_report = get_time_ns();
+    stats_enabled = true;
+}
+
+void stats_add(enum statistic stat, double value) {
+    if (!stats_enabled) return;
+    struct series *s = &series[stat];
+    if (s->count == 0 || value > s->max) s->max = value;
+    s->count++;
+    s->sum += value;
+    s->sum_squares += value * value;
+}
+
+void stats_report_if_due(void) {
+    if (!stats_enabled) return;
+    if (get_time_ns() - last_report >= interval_ns) stats_report();
+}
+
+void stats_report(void) {
+    if (!stats_enabled) return;
+    for (int i = 0; i < NUM_STATS; i++) {
+        struct series *s = &series[i];
+        if (s->count == 0) continue;
+        double mean = s->sum / s->count;
+        double rms = sqrt(s->sum_squares / s->count);
+        fprintf(stderr,
+                "%s (%s): n %llu, mean %.3f, rms %.3f, max %.3f\n",
+                s->name, s->unit, (unsigned long long) s->count, mean, rms, s->max);
+        s->count = 0;
+        s->sum = 0.0;
+        s->sum_squares = 0.0;
+        s->max = 0.0;
+    }
+    last_report = get_time_ns();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Running statistics of the render loop, printed to stderr periodically and
+// on exit. Nothing is collected unless `stats_init()` has been called.
+
+enum statistic {
+    // Distance from where the cursor lens was drawn to where the cursor was
+    // when the frame completed, with and without prediction (pixels)
+    STAT_PREDICTION_ERROR,
+    STAT_UNPREDICTED_ERROR,
+    // How late the rate limit sleep woke up (microseconds)
+    STAT_SLEEP_OVERSHOOT,
+    NUM_STATS
+};
+
+extern bool stats_enabled;
+
+// Print the statistics every `interval` seconds
+void stats_init(double interval);
+
+void stats_add(enum statistic stat, double value);
+
+// Print and reset the statistics if `interval` has passed since they were
+// last printed
+void stats_report_if_due(void);
+
+// Print and reset the statistics
+void stats_report(void);
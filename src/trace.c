@@ -0,0 +1,115 @@
+#include "trace.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef TRACE_CAPACITY
+#define TRACE_CAPACITY 65536
+#endif
+
+struct span {
+    const char *name;
+    unsigned long object;
+    uint64_t start;
+    uint64_t end;
+    uint64_t frame;
+    unsigned int cause;
+    // Name of the extra argument, or NULL if there is none
+    const char *arg_name;
+    long arg;
+};
+
+bool trace_enabled = false;
+
+static const char *trace_path;
+static struct span *spans;
+// Total number of spans recorded, including those overwritten since
+static uint64_t num_spans;
+static uint64_t frame;
+
+void trace_init(const char *path) {
+    trace_path = path;
+    spans = malloc(TRACE_CAPACITY * sizeof(struct span));
+    exit_error_if(spans == NULL, "Allocating trace buffer failed");
+    // Touch every page now, so that recording doesn't page fault
+    memset(spans, 0, TRACE_CAPACITY * sizeof(struct span));
+    trace_enabled = true;
+}
+
+uint64_t trace_now(void) {
+    if (!trace_enabled) return 0;
+    return get_time_ns();
+}
+
+static void record_span(struct span span) {
+    span.end = trace_now();
+    span.frame = frame;
+    spans[num_spans % TRACE_CAPACITY] = span;
+    num_spans++;
+}
+
+void trace_span(const char *name, unsigned long object, uint64_t start) {
+    if (!trace_enabled) return;
+    record_span((struct span) { .name = name, .object = object, .start = start });
+}
+
+void trace_span_arg(const char *name, const char *arg_name, long arg, uint64_t start) {
+    if (!trace_enabled) return;
+    record_span((struct span) { .name = name, .start = start, .arg_name = arg_name, .arg = arg });
+}
+
+void trace_begin_frame(void) {
+    frame++;
+}
+
+void trace_end_frame(unsigned int cause) {
+    if (!trace_enabled) return;
+    uint64_t oldest = num_spans > TRACE_CAPACITY ? num_spans - TRACE_CAPACITY : 0;
+    for (uint64_t i = num_spans; i > oldest; i--) {
+        struct span *span = &spans[(i - 1) % TRACE_CAPACITY];
+        if (span->frame != frame) break;
+        span->cause = cause;
+    }
+}
+
+static const char *cause_name(unsigned int cause) {
+    switch (cause) {
+        case TRACE_CAUSE_INPUT:
+            return "input";
+        case TRACE_CAUSE_DAMAGE:
+            return "damage";
+        case TRACE_CAUSE_INPUT | TRACE_CAUSE_DAMAGE:
+            return "input+damage";
+        default:
+            return "none";
+    }
+}
+
+void trace_write(void) {
+    if (!trace_enabled) return;
+    FILE *file = fopen(trace_path, "w");
+    if (file == NULL) exit_errno("Opening trace file failed");
+
+    pid_t pid = getpid();
+    fputs("{\"traceEvents\":[", file);
+    uint64_t oldest = num_spans > TRACE_CAPACITY ? num_spans - TRACE_CAPACITY : 0;
+    for (uint64_t i = oldest; i < num_spans; i++) {
+        const struct span *span = &spans[i % TRACE_CAPACITY];
+        fprintf(file, "%s\n{\"name\":\"%s", i == oldest ? "" : ",", span->name);
+        if (span->object != 0) fprintf(file, " 0x%lx", span->object);
+        fprintf(
+                file,
+                "\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"frame\":%llu,\"cause\":\"%s\"",
+                pid, pid, span->start / 1000.0, (span->end - span->start) / 1000.0,
+                (unsigned long long) span->frame, cause_name(span->cause));
+        if (span->arg_name != NULL) fprintf(file, ",\"%s\":%ld", span->arg_name, span->arg);
+        fputs("}}", file);
+    }
+    fputs("\n]}\n", file);
+
+    if (fclose(file) != 0) exit_errno("Writing trace file failed");
+}
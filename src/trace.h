@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Records timed spans of the render loop into a preallocated ring buffer and
+// writes them out as a Chrome trace event JSON file (loadable in Perfetto or
+// chrome://tracing). Only the most recent spans are kept once the ring is
+// full. Nothing is recorded unless `trace_init()` has been called.
+
+// What caused a frame to be drawn
+#define TRACE_CAUSE_INPUT (1 << 0)
+#define TRACE_CAUSE_DAMAGE (1 << 1)
+
+extern bool trace_enabled;
+
+// Preallocate the ring buffer. The file at `path` is written by
+// `trace_write()`.
+void trace_init(const char *path);
+
+// Get the start time of a span, in nanoseconds
+uint64_t trace_now(void);
+
+// Record a span from `start` until now. If `object` isn't 0, it is appended
+// to the span name in hexadecimal (e.g. a window ID).
+void trace_span(const char *name, unsigned long object, uint64_t start);
+
+// Record a span from `start` until now, with `arg` among its arguments under
+// `arg_name` (e.g. a tile number or a count of windows)
+void trace_span_arg(const char *name, const char *arg_name, long arg, uint64_t start);
+
+// Start tagging spans with a new frame number
+void trace_begin_frame(void);
+
+// Tag all spans of the current frame with what caused it
+void trace_end_frame(unsigned int cause);
+
+// Write the recorded spans to the trace file
+void trace_write(void);
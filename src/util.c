@@ -0,0 +1,42 @@
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void exit_error(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
+
+void exit_errno(const char *msg) {
+    fprintf(stderr, "%s: %s.\n", msg, strerror(errno));
+    exit(1);
+}
+
+void exit_error_if(bool cond, const char *msg) {
+    if (cond) exit_error(msg);
+}
+
+void exit_errno_if(int cond, const char *msg) {
+    if (cond == -1) exit_errno(msg);
+}
+
+uint64_t get_time_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+void reserve(void *array, size_t *cap, size_t needed, size_t size) {
+    if (needed <= *cap) return;
+    size_t new_cap = *cap == 0 ? 16 : *cap;
+    while (new_cap < needed) new_cap *= 2;
+    void **ptr = array;
+    void *new_ptr = realloc(*ptr, new_cap * size);
+    exit_error_if(new_ptr == NULL, "Allocating memory failed");
+    *ptr = new_ptr;
+    *cap = new_cap;
+}
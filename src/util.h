@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Print an error message to stderr, then exit with status 1
+void exit_error(const char *msg);
+void exit_errno(const char *msg);
+void exit_error_if(bool cond, const char *msg);
+void exit_errno_if(int cond, const char *msg);
+
+// CLOCK_MONOTONIC time in nanoseconds
+uint64_t get_time_ns(void);
+
+// Make room for at least `needed` elements of `size` bytes in the array
+// pointed to by `array`, growing it geometrically. Exits on failure.
+void reserve(void *array, size_t *cap, size_t needed, size_t size);
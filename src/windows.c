@@ -0,0 +1,358 @@
+#include "windows.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WINDOW_GRID_CELL_SIZE
+#define WINDOW_GRID_CELL_SIZE 256
+#endif
+
+struct cell {
+    unsigned int *slots;
+    unsigned int len;
+    size_t cap;
+};
+
+struct table_entry {
+    Window id;
+    unsigned int slot;
+};
+
+struct window_index {
+    struct rect grid_rect;
+    int cols;
+    int rows;
+    struct cell *cells;
+
+    // Windows are stored in slots which don't move when other windows are
+    // added or removed, so the grid can refer to them by slot number
+    struct indexed_window *windows;
+    unsigned int num_slots;
+    size_t slots_cap;
+    unsigned int *free_slots;
+    unsigned int num_free_slots;
+
+    // Slot numbers from the bottom of the stack to the top
+    unsigned int *stack;
+    unsigned int stack_len;
+
+    // Open addressing hash table from window ID to slot number
+    struct table_entry *table;
+    unsigned int table_cap;
+    unsigned int table_len;
+
+    // One bit per stack position, set for the windows a query has found so
+    // far. Reading the results out in stacking order clears it again.
+    uint64_t *found;
+
+    struct indexed_window **results;
+    size_t results_cap;
+    unsigned int query_mark;
+};
+
+static unsigned int hash_window(Window id, unsigned int cap) {
+    return (unsigned int) ((uint64_t) id * 0x9e3779b97f4a7c15ull >> 32) & (cap - 1);
+}
+
+static struct table_entry *table_find(struct window_index *index, Window id) {
+    if (index->table_cap == 0) return NULL;
+    unsigned int i = hash_window(id, index->table_cap);
+    while (index->table[i].id != None) {
+        if (index->table[i].id == id) return &index->table[i];
+        i = (i + 1) & (index->table_cap - 1);
+    }
+    return NULL;
+}
+
+static void table_insert(struct window_index *index, Window id, unsigned int slot) {
+    // Keep the table at most half full
+    if ((index->table_len + 1) * 2 > index->table_cap) {
+        struct table_entry *old_table = index->table;
+        unsigned int old_cap = index->table_cap;
+        index->table_cap = old_cap == 0 ? 64 : old_cap * 2;
+        index->table = calloc(index->table_cap, sizeof(struct table_entry));
+        exit_error_if(index->table == NULL, "Allocating window index failed");
+        index->table_len = 0;
+        for (unsigned int i = 0; i < old_cap; i++) {
+            if (old_table[i].id != None) table_insert(index, old_table[i].id, old_table[i].slot);
+        }
+        free(old_table);
+    }
+
+    unsigned int i = hash_window(id, index->table_cap);
+    while (index->table[i].id != None) i = (i + 1) & (index->table_cap - 1);
+    index->table[i] = (struct table_entry) { id, slot };
+    index->table_len++;
+}
+
+static void table_remove(struct window_index *index, struct table_entry *entry) {
+    unsigned int mask = index->table_cap - 1;
+    unsigned int hole = entry - index->table;
+    index->table[hole].id = None;
+    index->table_len--;
+
+    // Shift back any following entries which would no longer be reachable
+    // past the hole
+    unsigned int i = (hole + 1) & mask;
+    while (index->table[i].id != None) {
+        unsigned int home = hash_window(index->table[i].id, index->table_cap);
+        bool home_is_cyclically_after_hole = ((i - home) & mask) < ((i - hole) & mask);
+        if (!home_is_cyclically_after_hole) {
+            index->table[hole] = index->table[i];
+            index->table[i].id = None;
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+// Get the range of grid cells covered by `rect`. Returns false if `rect` is
+// entirely outside the grid, since windows are only indexed by their parts
+// inside the grid.
+static bool get_cells(
+        struct window_index *index, struct rect rect,
+        int *col_min, int *row_min, int *col_max, int *row_max)
+{
+    if (!rect_intersect(rect, index->grid_rect, &rect)) return false;
+    *col_min = rect.x / WINDOW_GRID_CELL_SIZE;
+    *row_min = rect.y / WINDOW_GRID_CELL_SIZE;
+    *col_max = (rect.x + rect.width - 1) / WINDOW_GRID_CELL_SIZE;
+    *row_max = (rect.y + rect.height - 1) / WINDOW_GRID_CELL_SIZE;
+    return true;
+}
+
+static void grid_insert(struct window_index *index, unsigned int slot) {
+    int col_min, row_min, col_max, row_max;
+    if (!get_cells(index, index->windows[slot].rect, &col_min, &row_min, &col_max, &row_max)) return;
+    for (int row = row_min; row <= row_max; row++) {
+        for (int col = col_min; col <= col_max; col++) {
+            struct cell *cell = &index->cells[row * index->cols + col];
+            reserve(&cell->slots, &cell->cap, cell->len + 1, sizeof(unsigned int));
+            cell->slots[cell->len++] = slot;
+        }
+    }
+}
+
+static void grid_remove(struct window_index *index, unsigned int slot) {
+    int col_min, row_min, col_max, row_max;
+    if (!get_cells(index, index->windows[slot].rect, &col_min, &row_min, &col_max, &row_max)) return;
+    for (int row = row_min; row <= row_max; row++) {
+        for (int col = col_min; col <= col_max; col++) {
+            struct cell *cell = &index->cells[row * index->cols + col];
+            for (unsigned int i = 0; i < cell->len; i++) {
+                if (cell->slots[i] == slot) {
+                    cell->slots[i] = cell->slots[--cell->len];
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Move the window at stack position `from` to position `to`, shifting the
+// windows in between
+static void stack_move(struct window_index *index, unsigned int from, unsigned int to) {
+    if (from == to) return;
+    unsigned int slot = index->stack[from];
+    if (from < to) {
+        memmove(&index->stack[from], &index->stack[from + 1], (to - from) * sizeof(unsigned int));
+    } else {
+        memmove(&index->stack[to + 1], &index->stack[to], (from - to) * sizeof(unsigned int));
+    }
+    index->stack[to] = slot;
+
+    unsigned int low = from < to ? from : to;
+    unsigned int high = from < to ? to : from;
+    for (unsigned int i = low; i <= high; i++) {
+        index->windows[index->stack[i]].stacking = i;
+    }
+}
+
+struct window_index *window_index_create(int width, int height) {
+    struct window_index *index = calloc(1, sizeof(*index));
+    exit_error_if(index == NULL, "Allocating window index failed");
+    index->cols = (width + WINDOW_GRID_CELL_SIZE - 1) / WINDOW_GRID_CELL_SIZE;
+    index->rows = (height + WINDOW_GRID_CELL_SIZE - 1) / WINDOW_GRID_CELL_SIZE;
+    if (index->cols < 1) index->cols = 1;
+    if (index->rows < 1) index->rows = 1;
+    index->grid_rect = (struct rect) {
+        0, 0, index->cols * WINDOW_GRID_CELL_SIZE, index->rows * WINDOW_GRID_CELL_SIZE
+    };
+    index->cells = calloc(index->cols * index->rows, sizeof(struct cell));
+    exit_error_if(index->cells == NULL, "Allocating window index failed");
+    return index;
+}
+
+void window_index_destroy(struct window_index *index) {
+    for (int i = 0; i < index->cols * index->rows; i++) {
+        free(index->cells[i].slots);
+    }
+    free(index->cells);
+    free(index->windows);
+    free(index->free_slots);
+    free(index->stack);
+    free(index->table);
+    free(index->found);
+    free(index->results);
+    free(index);
+}
+
+struct indexed_window *window_index_get(struct window_index *index, Window id) {
+    struct table_entry *entry = table_find(index, id);
+    return entry == NULL ? NULL : &index->windows[entry->slot];
+}
+
+void window_index_add(
+        struct window_index *index, Window id, struct rect rect, int depth, bool viewable)
+{
+    if (table_find(index, id) != NULL) return;
+
+    unsigned int slot;
+    if (index->num_free_slots > 0) {
+        slot = index->free_slots[--index->num_free_slots];
+    } else {
+        size_t old_cap = index->slots_cap;
+        reserve(&index->windows, &index->slots_cap, index->num_slots + 1, sizeof(struct indexed_window));
+        // Neither the stack nor the free list can hold more entries than
+        // there are slots
+        if (index->slots_cap != old_cap) {
+            index->stack = realloc(index->stack, index->slots_cap * sizeof(unsigned int));
+            index->free_slots = realloc(index->free_slots, index->slots_cap * sizeof(unsigned int));
+            free(index->found);
+            index->found = calloc((index->slots_cap + 63) / 64, sizeof(uint64_t));
+            exit_error_if(
+                    index->stack == NULL || index->free_slots == NULL || index->found == NULL,
+                    "Allocating window index failed");
+        }
+        slot = index->num_slots++;
+    }
+
+    index->windows[slot] = (struct indexed_window) {
+        .id = id,
+        .rect = rect,
+        .depth = depth,
+        .viewable = viewable,
+        .pixmap = None,
+        .picture = None,
+        .damage = None,
+        .stacking = index->stack_len,
+        .query_mark = index->query_mark
+    };
+    index->stack[index->stack_len++] = slot;
+    table_insert(index, id, slot);
+    grid_insert(index, slot);
+}
+
+void window_index_remove(struct window_index *index, Window id) {
+    struct table_entry *entry = table_find(index, id);
+    if (entry == NULL) return;
+    unsigned int slot = entry->slot;
+
+    grid_remove(index, slot);
+    table_remove(index, entry);
+    stack_move(index, index->windows[slot].stacking, index->stack_len - 1);
+    index->stack_len--;
+
+    index->free_slots[index->num_free_slots++] = slot;
+    index->windows[slot].id = None;
+}
+
+void window_index_move(struct window_index *index, Window id, struct rect rect) {
+    struct table_entry *entry = table_find(index, id);
+    if (entry == NULL) return;
+    struct indexed_window *window = &index->windows[entry->slot];
+    if (memcmp(&window->rect, &rect, sizeof(rect)) == 0) return;
+
+    grid_remove(index, entry->slot);
+    window->rect = rect;
+    grid_insert(index, entry->slot);
+}
+
+void window_index_set_viewable(struct window_index *index, Window id, bool viewable) {
+    struct indexed_window *window = window_index_get(index, id);
+    if (window != NULL) window->viewable = viewable;
+}
+
+void window_index_restack(struct window_index *index, Window id, Window above) {
+    struct indexed_window *window = window_index_get(index, id);
+    if (window == NULL) return;
+
+    unsigned int from = window->stacking;
+    unsigned int to;
+    if (above == None) {
+        to = 0;
+    } else {
+        struct indexed_window *sibling = window_index_get(index, above);
+        if (sibling == NULL) {
+            to = index->stack_len - 1;
+        } else if (sibling->stacking < from) {
+            to = sibling->stacking + 1;
+        } else {
+            // Everything between `from` and `sibling` shifts down by one
+            to = sibling->stacking;
+        }
+    }
+    stack_move(index, from, to);
+}
+
+void window_index_raise(struct window_index *index, Window id) {
+    struct indexed_window *window = window_index_get(index, id);
+    if (window != NULL) stack_move(index, window->stacking, index->stack_len - 1);
+}
+
+void window_index_lower(struct window_index *index, Window id) {
+    struct indexed_window *window = window_index_get(index, id);
+    if (window != NULL) stack_move(index, window->stacking, 0);
+}
+
+unsigned int window_index_query(
+        struct window_index *index, struct rect area, struct indexed_window ***windows)
+{
+    unsigned int num_results = 0;
+    int col_min, row_min, col_max, row_max;
+    if (get_cells(index, area, &col_min, &row_min, &col_max, &row_max)) {
+        rect_intersect(area, index->grid_rect, &area);
+        // Windows spanning several cells are only looked at once per query
+        unsigned int mark = ++index->query_mark;
+        unsigned int lowest = index->stack_len;
+        unsigned int highest = 0;
+        for (int row = row_min; row <= row_max; row++) {
+            for (int col = col_min; col <= col_max; col++) {
+                struct cell *cell = &index->cells[row * index->cols + col];
+                for (unsigned int i = 0; i < cell->len; i++) {
+                    struct indexed_window *window = &index->windows[cell->slots[i]];
+                    if (window->query_mark == mark) continue;
+                    window->query_mark = mark;
+                    if (!window->viewable || !rect_overlaps(window->rect, area)) continue;
+
+                    unsigned int stacking = window->stacking;
+                    index->found[stacking / 64] |= 1ull << (stacking % 64);
+                    if (stacking < lowest) lowest = stacking;
+                    if (stacking > highest) highest = stacking;
+                    num_results++;
+                }
+            }
+        }
+
+        // The found windows come out of the bitmap in stacking order, without
+        // having to sort them
+        if (num_results > 0) {
+            reserve(&index->results, &index->results_cap, num_results, sizeof(*index->results));
+            unsigned int n = 0;
+            for (unsigned int word = lowest / 64; word <= highest / 64; word++) {
+                uint64_t bits = index->found[word];
+                index->found[word] = 0;
+                while (bits != 0) {
+                    unsigned int stacking = word * 64 + __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    index->results[n++] = &index->windows[index->stack[stacking]];
+                }
+            }
+        }
+    }
+
+    *windows = index->results;
+    return num_results;
+}
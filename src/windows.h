@@ -0,0 +1,64 @@
+#pragma once
+
+#include "rect.h"
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xrender.h>
+
+#include <stdbool.h>
+
+// Tracks the geometry and stacking order of the top-level windows, so the
+// windows under the lenses can be found without asking the X server. Window
+// rectangles are kept in a uniform grid over the root window, so a lookup only
+// visits the windows in the grid cells it overlaps.
+struct window_index;
+
+struct indexed_window {
+    Window id;
+    struct rect rect;
+    int border_width;
+    int depth;
+    bool viewable;
+
+    // The window's named composite pixmap and a picture of it, or None.
+    // These are managed by the user of the index.
+    Pixmap pixmap;
+    Picture picture;
+    // The damage object reporting changes to the window, or None. Also
+    // managed by the user of the index.
+    Damage damage;
+
+    // Internal bookkeeping
+    unsigned int stacking;
+    unsigned int query_mark;
+};
+
+struct window_index *window_index_create(int width, int height);
+void window_index_destroy(struct window_index *index);
+
+// Returns NULL if `id` isn't tracked
+struct indexed_window *window_index_get(struct window_index *index, Window id);
+
+// Add a window on top of all other windows
+void window_index_add(
+        struct window_index *index, Window id, struct rect rect, int depth, bool viewable);
+void window_index_remove(struct window_index *index, Window id);
+
+void window_index_move(struct window_index *index, Window id, struct rect rect);
+void window_index_set_viewable(struct window_index *index, Window id, bool viewable);
+
+// Restack `id` directly above `above`, or at the bottom if `above` is None.
+// If `above` isn't tracked, `id` is put on top.
+void window_index_restack(struct window_index *index, Window id, Window above);
+
+// Put `id` on top of (or below) all other windows
+void window_index_raise(struct window_index *index, Window id);
+void window_index_lower(struct window_index *index, Window id);
+
+// Find the viewable windows which overlap `area`, ordered from bottom to top.
+// Only the part of `area` inside the root window is considered.
+// The returned array belongs to the index and is valid until the index is
+// next queried or modified.
+unsigned int window_index_query(
+        struct window_index *index, struct rect area, struct indexed_window ***windows);
@@ -0,0 +1,196 @@
+// Benchmark of the window index (`src/windows.c`) against a linear scan of
+// the stacking order, which is what finding the windows under the lenses
+// cost before the index. Builds a screen of synthetic windows, then runs
+// rounds of moves, restacks and lens-sized queries, e.g.
+//
+//     mgnfx-windows-bench -n 1000 -q 100000
+//
+// Every query's result is checked against the linear scan, so this doubles as
+// a test of the index. Exits with status 1 on the first mismatch.
+
+#define _GNU_SOURCE
+
+#include "util.h"
+#include "windows.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCREEN_WIDTH 3840
+#define SCREEN_HEIGHT 2160
+#define LENS_SIZE 400
+
+// The reference: windows from the bottom of the stack to the top
+struct linear_window {
+    Window id;
+    struct rect rect;
+    bool viewable;
+};
+
+static struct linear_window *linear_windows;
+static unsigned int num_linear_windows;
+
+static unsigned int linear_find(Window id) {
+    for (unsigned int i = 0; i < num_linear_windows; i++) {
+        if (linear_windows[i].id == id) return i;
+    }
+    return num_linear_windows;
+}
+
+// Move the window at `from` in the stack to `to`, shifting the ones between
+static void linear_stack_move(unsigned int from, unsigned int to) {
+    struct linear_window window = linear_windows[from];
+    if (from < to) {
+        memmove(&linear_windows[from], &linear_windows[from + 1], (to - from) * sizeof(window));
+    } else {
+        memmove(&linear_windows[to + 1], &linear_windows[to], (from - to) * sizeof(window));
+    }
+    linear_windows[to] = window;
+}
+
+static void linear_restack(Window id, Window above) {
+    unsigned int from = linear_find(id);
+    if (above == None) {
+        linear_stack_move(from, 0);
+        return;
+    }
+    unsigned int sibling = linear_find(above);
+    if (sibling == num_linear_windows) {
+        linear_stack_move(from, num_linear_windows - 1);
+    } else {
+        linear_stack_move(from, sibling < from ? sibling + 1 : sibling);
+    }
+}
+
+static unsigned int linear_query(struct rect area, Window *results) {
+    unsigned int num_results = 0;
+    for (unsigned int i = 0; i < num_linear_windows; i++) {
+        if (linear_windows[i].viewable && rect_overlaps(linear_windows[i].rect, area)) {
+            results[num_results++] = linear_windows[i].id;
+        }
+    }
+    return num_results;
+}
+
+static int random_int(int min, int max) {
+    return min + rand() % (max - min + 1);
+}
+
+// Mostly ordinary application windows, with a few large ones (maximized
+// windows, panels and the like) mixed in
+static struct rect random_window_rect(void) {
+    int width = rand() % 10 == 0 ? random_int(1000, SCREEN_WIDTH) : random_int(50, 800);
+    int height = rand() % 10 == 0 ? random_int(800, SCREEN_HEIGHT) : random_int(30, 600);
+    return (struct rect) {
+        random_int(-100, SCREEN_WIDTH - 50), random_int(-100, SCREEN_HEIGHT - 30), width, height
+    };
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "Usage: mgnfx-windows-bench [-n WINDOWS] [-q QUERIES] [-s SEED]";
+    int num_windows = 1000;
+    int num_queries = 100000;
+    unsigned int seed = 1;
+    int optchar;
+    while ((optchar = getopt(argc, argv, "n:q:s:")) != -1) {
+        switch (optchar) {
+            case 'n':
+                num_windows = atoi(optarg);
+                break;
+            case 'q':
+                num_queries = atoi(optarg);
+                break;
+            case 's':
+                seed = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "%s\n", usage);
+                return 1;
+        }
+    }
+    if (num_windows < 1 || num_queries < 1) {
+        fprintf(stderr, "%s\n", usage);
+        return 1;
+    }
+    srand(seed);
+
+    linear_windows = calloc(num_windows, sizeof(struct linear_window));
+    Window *linear_results = calloc(num_windows, sizeof(Window));
+    if (linear_windows == NULL || linear_results == NULL) {
+        fputs("Allocating windows failed\n", stderr);
+        return 1;
+    }
+
+    struct window_index *index = window_index_create(SCREEN_WIDTH, SCREEN_HEIGHT);
+    uint64_t start = get_time_ns();
+    for (int i = 0; i < num_windows; i++) {
+        Window id = 0x1000000 + i * 7;
+        struct rect rect = random_window_rect();
+        bool viewable = rand() % 5 != 0;
+        window_index_add(index, id, rect, 24, viewable);
+        linear_windows[num_linear_windows++] = (struct linear_window) { id, rect, viewable };
+    }
+    uint64_t add_ns = get_time_ns() - start;
+
+    // Each round changes the layout a little, the way window events do
+    // between frames, then queries where a lens might be
+    uint64_t change_ns = 0;
+    uint64_t index_ns = 0;
+    uint64_t linear_ns = 0;
+    unsigned long total_results = 0;
+    for (int q = 0; q < num_queries; q++) {
+        Window id = linear_windows[rand() % num_linear_windows].id;
+        struct rect rect = random_window_rect();
+        Window above = rand() % 20 == 0 ? None : linear_windows[rand() % num_linear_windows].id;
+        if (above == id) above = None;
+
+        start = get_time_ns();
+        window_index_move(index, id, rect);
+        window_index_restack(index, id, above);
+        change_ns += get_time_ns() - start;
+        linear_windows[linear_find(id)].rect = rect;
+        linear_restack(id, above);
+
+        struct rect area = {
+            random_int(0, SCREEN_WIDTH - LENS_SIZE), random_int(0, SCREEN_HEIGHT - LENS_SIZE),
+            LENS_SIZE, LENS_SIZE
+        };
+
+        start = get_time_ns();
+        struct indexed_window **results;
+        unsigned int num_results = window_index_query(index, area, &results);
+        index_ns += get_time_ns() - start;
+
+        start = get_time_ns();
+        unsigned int num_linear_results = linear_query(area, linear_results);
+        linear_ns += get_time_ns() - start;
+
+        bool matches = num_results == num_linear_results;
+        for (unsigned int i = 0; i < num_results && matches; i++) {
+            matches = results[i]->id == linear_results[i];
+        }
+        if (!matches) {
+            fprintf(stderr,
+                    "Query %d returned %u windows, the linear scan %u or in another order\n",
+                    q, num_results, num_linear_results);
+            return 1;
+        }
+        total_results += num_results;
+    }
+
+    printf("%d windows, %d queries of %dx%d, %.1f windows per query\n",
+            num_windows, num_queries, LENS_SIZE, LENS_SIZE, (double) total_results / num_queries);
+    printf("add:           %8.3f us per window\n", add_ns / 1e3 / num_windows);
+    printf("move+restack:  %8.3f us\n", change_ns / 1e3 / num_queries);
+    printf("index query:   %8.3f us\n", index_ns / 1e3 / num_queries);
+    printf("linear scan:   %8.3f us\n", linear_ns / 1e3 / num_queries);
+
+    window_index_destroy(index);
+    free(linear_windows);
+    free(linear_results);
+    return 0;
+}
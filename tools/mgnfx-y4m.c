@@ -0,0 +1,163 @@
+// Reference consumer for the frame ring published by `mgnfx -x PATH`. Writes
+// every frame it sees to stdout as a YUV4MPEG2 stream with 4:4:4 chroma, e.g.
+//
+//     mgnfx-y4m /run/user/1000/mgnfx-frames | ffmpeg -i - lens.mkv
+//
+// Only frames of one lens are written (`-l`, default 0, the lens following
+// the cursor). The output size is fixed by the first frame; later frames of a
+// different size are cropped or padded with black. Exits once mgnfx stops
+// publishing.
+
+#define _GNU_SOURCE
+
+#include "frames.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static void exit_errno(const char *msg) {
+    fprintf(stderr, "%s: %s.\n", msg, strerror(errno));
+    exit(1);
+}
+
+static void exit_error(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
+
+static unsigned char clamp_byte(int i) {
+    return i < 0 ? 0 : i > 255 ? 255 : i;
+}
+
+// Convert BGRX pixels to BT.601 limited range Y, Cb and Cr planes of
+// `out_width` by `out_height`, padding with black where `pixels` is smaller
+static void convert_frame(
+        const unsigned char *pixels, int width, int height, int stride,
+        int out_width, int out_height, unsigned char *planes)
+{
+    size_t plane_size = (size_t) out_width * out_height;
+    unsigned char *y_plane = planes;
+    unsigned char *u_plane = planes + plane_size;
+    unsigned char *v_plane = planes + plane_size * 2;
+
+    for (int row = 0; row < out_height; row++) {
+        for (int col = 0; col < out_width; col++) {
+            int r = 0;
+            int g = 0;
+            int b = 0;
+            if (row < height && col < width) {
+                const unsigned char *p = pixels + (size_t) row * stride + col * 4;
+                b = p[0];
+                g = p[1];
+                r = p[2];
+            }
+            size_t i = (size_t) row * out_width + col;
+            y_plane[i] = clamp_byte(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            u_plane[i] = clamp_byte(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            v_plane[i] = clamp_byte(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *usage = "Usage: mgnfx-y4m [-r FRAME_RATE] [-l LENS] PATH";
+    int rate = 60;
+    unsigned int lens = 0;
+    int optchar;
+    while ((optchar = getopt(argc, argv, "r:l:")) != -1) {
+        switch (optchar) {
+            case 'r':
+                rate = atoi(optarg);
+                break;
+            case 'l':
+                lens = atoi(optarg);
+                break;
+            default:
+                exit_error(usage);
+        }
+    }
+    if (optind != argc - 1) exit_error(usage);
+
+    int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) exit_errno("Opening frame ring failed");
+
+    struct frames_header *header = mmap(NULL, FRAMES_HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) exit_errno("Mapping frame ring header failed");
+    if (header->magic != FRAMES_MAGIC || header->version != FRAMES_VERSION) {
+        exit_error("Not a mgnfx frame ring, or an incompatible version");
+    }
+
+    if (lens >= header->num_lenses) exit_error("No such lens");
+
+    // Everything up to the end of this lens's slots
+    const struct frames_lens *ring = &header->lenses[lens];
+    size_t size = ring->offset + (size_t) ring->num_slots * ring->slot_size;
+    const unsigned char *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) exit_errno("Mapping frame ring failed");
+    header = (struct frames_header *) base;
+    ring = &header->lenses[lens];
+
+    unsigned char *pixels = malloc(ring->slot_size);
+    if (pixels == NULL) exit_error("Allocating frame buffer failed");
+    unsigned char *planes = NULL;
+    int out_width = 0;
+    int out_height = 0;
+
+    uint64_t last = 0;
+    while (true) {
+        uint64_t latest = __atomic_load_n(&ring->latest, __ATOMIC_ACQUIRE);
+        if (latest == last) {
+            if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE)) break;
+            struct timespec interval = { .tv_nsec = 1000000 };
+            nanosleep(&interval, NULL);
+            continue;
+        }
+
+        // Write every frame since the last one seen. Frames older than the
+        // ring are gone.
+        uint64_t sequence = last + 1;
+        if (latest - last > ring->num_slots) sequence = latest - ring->num_slots + 1;
+        last = sequence;
+
+        const unsigned char *slot =
+            base + ring->offset + (sequence % ring->num_slots) * ring->slot_size;
+        const struct frame_header *frame = (const struct frame_header *) slot;
+        if (__atomic_load_n(&frame->sequence, __ATOMIC_ACQUIRE) != sequence) continue;
+
+        struct frame_header copy = *frame;
+        size_t frame_size = (size_t) copy.stride * copy.height;
+        if (frame_size > ring->slot_size - FRAME_HEADER_SIZE) continue;
+        memcpy(pixels, slot + FRAME_HEADER_SIZE, frame_size);
+
+        // If the producer started rewriting this slot while we copied it, the
+        // copy is torn and the frame is lost
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&frame->sequence, __ATOMIC_RELAXED) != sequence) continue;
+
+        if (planes == NULL) {
+            out_width = copy.width;
+            out_height = copy.height;
+            planes = malloc((size_t) out_width * out_height * 3);
+            if (planes == NULL) exit_error("Allocating output buffer failed");
+            printf("YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", out_width, out_height, rate);
+        }
+
+        convert_frame(
+                pixels, copy.width, copy.height, copy.stride,
+                out_width, out_height, planes);
+        fputs("FRAME\n", stdout);
+        if (fwrite(planes, (size_t) out_width * out_height * 3, 1, stdout) != 1) {
+            exit_errno("Writing frame failed");
+        }
+    }
+
+    fflush(stdout);
+    return 0;
+}